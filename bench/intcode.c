@@ -0,0 +1,286 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "intcode.h"
+
+/* minimum time spent on each workload */
+#define MIN_SECONDS 1.0
+
+struct workload
+{
+	const char *name;
+	int64_t *program;
+	size_t pcount;
+	int64_t (*run)(struct workload *w, uint64_t *steps);
+	int64_t input[2];	/* inputs of run_program() */
+};
+
+/*
+ * Sum of the primes below the input, with a sieve of Eratosthenes
+ * kept above the program and walked by rbp:
+ *
+ *	rbp = &sieve[2]
+ *	for (i = 2; i < n; i++, rbp++)
+ *		if (![rbp])
+ *			sum += i
+ *			for (j = i*i, rbp += j-i; j < n; j += i, rbp += i)
+ *				[rbp] = 1
+ *			rbp -= j-i
+ *	output(sum)
+ */
+static const int64_t sum_of_primes[] = {
+	3,86,109,94,1101,2,0,87,1101,0,0,88,7,87,86,89,1006,89,83,1205,
+	0,74,1,88,87,88,2,87,87,90,7,90,86,89,1006,89,74,1002,87,-1,91,1,
+	90,91,91,9,91,21101,1,0,0,1,90,87,90,9,87,7,90,86,89,1005,89,47,
+	1002,90,-1,91,1,87,91,91,9,91,1001,87,1,87,109,1,1105,1,12,4,88,
+	99,0,0,0,0,0,0,
+};
+
+/*
+ * Ackermann function of the two inputs, a recursive call for each
+ * step with the frames on a stack at rbp:
+ *
+ *	A(m, n) = m == 0 ? n + 1
+ *		: n == 0 ? A(m-1, 1)
+ *		: A(m-1, A(m, n-1))
+ */
+static const int64_t ackermann[] = {
+	3,108,3,109,109,1000,21101,21,0,0,21001,108,0,1,21001,109,0,2,
+	1105,1,24,204,3,99,1205,1,34,21201,2,1,3,2106,0,0,1205,2,63,21101,
+	54,0,4,21201,1,-1,5,21101,1,0,6,109,4,1105,1,24,109,-4,22101,0,7,
+	3,2106,0,0,21101,80,0,4,22101,0,1,5,21201,2,-1,6,109,4,1105,1,24,
+	109,-4,22101,0,7,6,21101,99,0,4,21201,1,-1,5,109,4,1105,1,24,109,
+	-4,22101,0,7,3,2106,0,0,0,0,
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* a single run that takes the inputs of the workload, the result is
+ * the last output */
+static int64_t run_program(struct workload *w, uint64_t *steps)
+{
+	struct module *m = module_new();
+	assert(m);
+	module_load(m, w->program, w->pcount);
+	module_push_inputs(m, w->input, 2);
+	module_execute(m);
+	int64_t result = 0;
+	while (!module_output_empty(m))
+	{
+		result = module_pop_output(m);
+	}
+	*steps += module_steps(m);
+	module_free(m);
+	return result;
+}
+
+/* day19: the beam in the 50x50 area, one program per point */
+static int64_t run_day19(struct workload *w, uint64_t *steps)
+{
+	struct module *m = module_new();
+	assert(m);
+	int64_t count = 0;
+	for (int y = 0; y < 50; y++)
+	{
+		for (int x = 0; x < 50; x++)
+		{
+			module_load(m, w->program, w->pcount);
+			module_push_input(m, x);
+			module_push_input(m, y);
+			module_execute(m);
+			count += module_pop_output(m);
+			*steps += module_steps(m);
+		}
+	}
+	module_free(m);
+	return count;
+}
+
+/* day23: the whole network until the NAT repeats itself */
+static int64_t run_day23(struct workload *w, uint64_t *steps)
+{
+	struct module *comp[50];
+	for (int i = 0; i < 50; i++)
+	{
+		comp[i] = module_new();
+		assert(comp[i]);
+		module_load(comp[i], w->program, w->pcount);
+		module_push_input(comp[i], i);
+	}
+
+	int64_t natx = INT64_MAX;
+	int64_t naty = INT64_MAX;
+	int64_t lasty = INT64_MAX;
+	int last_running = -1;
+	int i = 0;
+	for (;;)
+	{
+		struct module *c = comp[i];
+		module_execute(c);
+		if (module_output_len(c) >= 3)
+		{
+			last_running = i;
+			int dst = module_pop_output(c);
+			int64_t x = module_pop_output(c);
+			int64_t y = module_pop_output(c);
+			if (dst == 255)
+			{
+				natx = x;
+				naty = y;
+				i = (i + 1) % 50;
+			}
+			else
+			{
+				last_running = -1;
+				i = dst;
+				module_push_input(comp[i], x);
+				module_push_input(comp[i], y);
+			}
+		}
+		else
+		{
+			module_push_input(c, -1);
+			i = (i + 1) % 50;
+		}
+
+		if (i == last_running)
+		{
+			if (lasty == naty)
+			{
+				break;
+			}
+			lasty = naty;
+			i = 0;
+			module_push_input(comp[i], natx);
+			module_push_input(comp[i], naty);
+		}
+	}
+
+	for (i = 0; i < 50; i++)
+	{
+		*steps += module_steps(comp[i]);
+		module_free(comp[i]);
+	}
+	return naty;
+}
+
+/*
+ * Loading the same program again, from the program or from an image,
+ * must not reuse what the engine derived from the previous run: here
+ * a loop hot enough to be compiled counts in a cell past the memory
+ * of the image.
+ */
+static void check_reload(void)
+{
+	static const int64_t count[] = {
+		1105,1,3, 1001,40000,1,40000, 1001,100,1,100,
+		1007,100,1000,101, 1005,101,3, 4,40000, 99,
+	};
+	size_t n = sizeof(count)/sizeof(count[0]);
+	struct module *m = module_new();
+	struct image *img = image_new(count, n);
+	assert(m && img);
+	for (int k = 0; k < 4; k++)
+	{
+		if (k & 1)
+		{
+			module_load_image(m, img);
+		}
+		else
+		{
+			module_load(m, count, n);
+		}
+		module_execute(m);
+		assert(module_pop_output(m) == 1000);
+	}
+	image_free(img);
+	module_free(m);
+}
+
+static void bench(struct workload *w)
+{
+	uint64_t steps = 0;
+	unsigned runs = 0;
+	int64_t result = 0;
+	double start = now();
+	double elapsed;
+	do
+	{
+		result = w->run(w, &steps);
+		runs++;
+		elapsed = now() - start;
+	} while (elapsed < MIN_SECONDS);
+
+	/* NOTE: the peak of the whole process, in KiB on Linux */
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("%-8s %-10s result %-16" PRId64 " runs %-6u insns %-12" PRIu64
+	       " time %8.3fs %10.2f Minsn/s rss %8ldK\n",
+	       ENGINE, w->name, result, runs, steps, elapsed,
+	       steps / elapsed * 1e-6, ru.ru_maxrss);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 4)
+	{
+		fprintf(stderr, "Usage: %s <day9 input> <day23 input> <day19 input>\n", argv[0]);
+		return -1;
+	}
+
+	struct workload workloads[] = {
+		{ "day9", NULL, 0, run_program, { 2 } },
+		{ "day23", NULL, 0, run_day23 },
+		{ "day19", NULL, 0, run_day19 },
+		{ "primes", (int64_t *)sum_of_primes,
+		  sizeof(sum_of_primes)/sizeof(sum_of_primes[0]),
+		  run_program, { 60000 } },
+		{ "ackermann", (int64_t *)ackermann,
+		  sizeof(ackermann)/sizeof(ackermann[0]),
+		  run_program, { 3, 7 } },
+	};
+	size_t nworkloads = sizeof(workloads)/sizeof(workloads[0]);
+
+	/* the puzzles are loaded from the inputs, the other
+	 * programs are built in */
+	size_t nloaded = 0;
+	for (size_t i = 0; i < nworkloads && !workloads[i].program; i++, nloaded++)
+	{
+		FILE *input = fopen(argv[i+1], "rb");
+		if (!input)
+		{
+			fprintf(stderr, "File %s not found\n", argv[i+1]);
+			return -1;
+		}
+		workloads[i].program = program_load(input, &workloads[i].pcount);
+		fclose(input);
+		if (!workloads[i].program)
+		{
+			fprintf(stderr, "Cannot load the intcode program\n");
+			return -1;
+		}
+	}
+
+	check_reload();
+	for (size_t i = 0; i < nworkloads; i++)
+	{
+		bench(workloads + i);
+		if (i < nloaded)
+		{
+			free(workloads[i].program);
+		}
+	}
+	return 0;
+}
@@ -5,259 +5,12 @@
 #include <stdlib.h>
 #include <string.h>
 
-enum
-{
-	/* opcodes */
-	OP_ADD	= 1,		/* [c] = [a] + [b]        */
-	OP_MUL	= 2,		/* [c] = [a] * [b]        */
-	OP_IN	= 3,		/* [a] = <input>          */
-	OP_OUT	= 4,		/* output([a])            */
-	OP_JNZ	= 5,		/* if ([a] != 0) goto [b] */
-	OP_JZ	= 6,		/* if ([a] == 0) goto [b] */
-	OP_TLT	= 7,		/* [c] = [a] < [b]        */
-	OP_TEQ	= 8,		/* [c] = [a] == [b]       */
-	OP_ARB  = 9,		/* rbp += [a]             */
-	OP_HALT = 99,
-
-	/* addressing modes */
-	PMODE = 0,		/* absolute index */
-	IMODE = 1,		/* immediate literal */
-	RMODE = 2,		/* relative index (to rbp) */
-
-	/* state of the execution */
-	INPUT_EMPTY = 0,
-	OUTPUT_FULL = 1,
-	HALTED = 2,
-};
-
-struct module
-{
-	int64_t *ram;
-	size_t size;
-	int64_t pc;		/* instruction/program counter */
-	int64_t rbp;		/* relative base pointer */
-
-	int64_t inq[32];
-	size_t ri, wi;
-
-	int64_t outq[32];
-	size_t ro, wo;
-};
-
-static void module_free(struct module *m)
-{
-	if (m)
-	{
-		free(m->ram);
-		free(m);
-	}
-}
-
-static struct module *module_new(void)
-{
-	return calloc(1, sizeof(struct module));
-}
-
-static int64_t address_of(struct module *m, int64_t pos, int mode)
-{
-	while ((size_t)pos >= m->size)
-	{
-		size_t nsize = m->size ? m->size * 2 : 1024;
-		int64_t *nram = realloc(m->ram, nsize * sizeof(*nram));
-		assert(nram);
-
-		/* NOTE: realloc() doesn't guarantee that the added
-		 * memory is zeroed. */
-		memset(nram+m->size, 0, nsize - m->size);
-		m->size = nsize;
-		m->ram = nram;
-	}
-
-	switch(mode)
-	{
-	case IMODE: return pos;
-	case PMODE: return address_of(m, m->ram[pos], IMODE);
-	case RMODE: return address_of(m, m->rbp + m->ram[pos], IMODE);
-	default:
-		fprintf(stderr, "Unknown addressing mode: %d\n", mode);
-		abort();
-	}
-}
-
-static void module_load(struct module *m, const int64_t *prog, size_t psize)
-{
-	/* NOTE: forces a reallocation */
-	address_of(m, psize, IMODE);
-
-	/* reset the memory and copy the program */
-	memcpy(m->ram, prog, psize * sizeof(m->ram[0]));
-	memset(m->ram+psize, 0, (m->size - psize) * sizeof(m->ram[0]));
-
-	m->pc = 0;
-	m->rbp = 0;
-	m->ri = m->wi = m->ro = m->wo = 0;
-}
-
-static void module_push_input(struct module *m, int64_t value)
-{
-	assert(m->wi - m->ri < 32);
-	m->inq[(m->wi++) & 31] = value;
-}
-
-static int64_t module_pop_output(struct module *m)
-{
-	assert(m->wo != m->ro);
-	return m->outq[(m->ro++) & 31];
-}
-
-static int module_execute(struct module *m)
-{
-	for (;;)
-	{
-		int op;
-		div_t d = div(m->ram[m->pc], 100);
-		op = d.rem;
-		d = div(d.quot, 10);
-		int a_mode = d.rem;
-		d = div(d.quot, 10);
-		int b_mode = d.rem;
-		d = div(d.quot, 10);
-		int c_mode = d.rem;
-
-		int64_t a, b, c;
-		switch (op)
-		{
-		case OP_ADD:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode != IMODE);
-			m->ram[c] = m->ram[a] + m->ram[b];
-			m->pc += 4;
-			break;
-
-		case OP_MUL:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode != IMODE);
-			m->ram[c] = m->ram[a] * m->ram[b];
-			m->pc += 4;
-			break;
-
-		case OP_IN:
-			a = address_of(m, m->pc+1, a_mode);
-			assert(a_mode != IMODE);
-			if (m->wi == m->ri)
-			{
-				return INPUT_EMPTY;
-			}
-			m->ram[a] = m->inq[(m->ri++) & 31];
-			m->pc += 2;
-			break;
-
-		case OP_OUT:
-			a = address_of(m, m->pc+1, a_mode);
-			if (m->wo - m->ro < 32)
-			{
-				m->outq[(m->wo++) & 31] = m->ram[a];
-			}
-			else
-			{
-				return OUTPUT_FULL;
-			}
-			m->pc += 2;
-			break;
-
-		case OP_JNZ:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			if (m->ram[a] != 0)
-			{
-				m->pc = m->ram[b];
-			}
-			else
-			{
-				m->pc += 3;
-			}
-			break;
-
-		case OP_JZ:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			if (m->ram[a] == 0)
-			{
-				m->pc = m->ram[b];
-			}
-			else
-			{
-				m->pc += 3;
-			}
-			break;
-
-		case OP_TLT:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode != IMODE);
-			m->ram[c] = m->ram[a] < m->ram[b] ? 1 : 0;
-			m->pc += 4;
-			break;
-
-		case OP_TEQ:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode != IMODE);
-			m->ram[c] = m->ram[a] == m->ram[b] ? 1 : 0;
-			m->pc += 4;
-			break;
-
-		case OP_ARB:
-			a = address_of(m, m->pc+1, a_mode);
-			m->rbp += m->ram[a];
-			m->pc += 2;
-			break;
-
-		case OP_HALT:
-			return HALTED;
-
-		default:
-			fprintf(stderr, "Unknown opcode %" SCNd64 " at %" SCNd64 "\n",
-				m->ram[m->pc], m->pc);
-			abort();
-		}
-	}
-}
-
-static int64_t *program_load(FILE *input, size_t *count)
-{
-	int64_t *array = NULL;
-	size_t acount = 0;
-	size_t asize = 0;
-
-	int64_t value;
-	while (fscanf(input, "%" SCNd64 ",", &value) == 1)
-	{
-		if (acount == asize)
-		{
-			size_t newsize = asize ? asize * 2 : 32;
-			int64_t *newarray = realloc(array, newsize * sizeof(*newarray));
-			if (!newarray)
-			{
-				abort();
-			}
-			asize = newsize;
-			array = newarray;
-		}
-		array[acount++] = value;
-	}
-	*count = acount;
-	return array;
-}
+#include "intcode.h"
 
 static size_t psize;
 static int64_t *program;
+static struct expr *beam;	/* output for the inputs x, y or NULL */
+static struct snapshot *start;	/* the program reads x */
 
 static int check_point(struct module *m, int x, int y)
 {
@@ -266,11 +19,16 @@ static int check_point(struct module *m, int x, int y)
 		return 0;
 	}
 
-	module_load(m, program, psize);
+	if (beam)
+	{
+		return expr_eval(beam, (int64_t[]){ x, y });
+	}
+
+	module_restore(m, start);
 	module_push_input(m, x);
 	module_push_input(m, y);
 	module_execute(m);
-	if (m->ro != m->wo)
+	if (!module_output_empty(m))
 	{
 		return module_pop_output(m);
 	}
@@ -301,18 +59,52 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	struct module *m = module_new();
-	if (m)
+	/* the probes are evaluated in closed form when the program
+	 * does not branch on x and y */
+	struct symbolic *s = program_symbolic(program, psize, NULL, 0, NULL, 0, 100000);
+	if (s && symbolic_outputs(s) == 1)
 	{
-		int count = 0;
-		for (int y = 0; y < 50; y++)
+		beam = symbolic_output(s, 0);
+	}
+	symbolic_free(s);
+
+	/* otherwise the probes of the 50x50 area run in lockstep */
+	int64_t probes[50*50][2];
+	int64_t area[50*50];
+	for (int y = 0; y < 50; y++)
+	{
+		for (int x = 0; x < 50; x++)
 		{
-			for (int x = 0; x < 50; x++)
-			{
-				count += check_point(m, x, y);
-			}
+			probes[y*50+x][0] = x;
+			probes[y*50+x][1] = y;
 		}
-		printf("part1: %d\n", count);
+	}
+	if (beam)
+	{
+		for (int i = 0; i < 50*50; i++)
+		{
+			area[i] = expr_eval(beam, probes[i]);
+		}
+	}
+	else
+	{
+		program_batch(program, psize, 50*50, probes[0], 2, area, 1);
+	}
+	int count = 0;
+	for (int i = 0; i < 50*50; i++)
+	{
+		count += area[i];
+	}
+	printf("part1: %d\n", count);
+
+	/* the probes start from the first read of the program */
+	struct module *m = module_new();
+	if (m)
+	{
+		module_load(m, program, psize);
+		module_execute(m);
+		start = module_snapshot(m);
+		assert(start);
 
 		int x = 0;
 		int y = 0;
@@ -325,10 +117,13 @@ int main(int argc, char *argv[])
 			}
 		}
 		printf("part2: %d\n", x * 10000 + y);
+		snapshot_free(start);
 		module_free(m);
 	}
 
-	/* NOTE: program is a global variable used by check_point() */
+	/* NOTE: program and beam are global variables used by
+	 * check_point() */
+	expr_free(beam);
 	free(program);
 	return 0;
 }
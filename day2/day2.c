@@ -1,61 +1,11 @@
 #include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-enum
-{
-	OP_ADD = 1,
-	OP_MUL = 2,
-	OP_HALT = 99,
-};
-
-void execute(int *array, size_t size)
-{
-	int pc = 0;
-	for (;;)
-	{
-		size_t a, b, c;
-		switch (array[pc])
-		{
-		case OP_ADD:
-			a = array[pc+1];
-			b = array[pc+2];
-			c = array[pc+3];
-			if (a >= size || b >= size || c >= size)
-			{
-				fprintf(stderr, "out of bounds\n");
-			}
-			else
-			{
-				array[c] = array[a] + array[b];
-			}
-			break;
-
-		case OP_MUL:
-			a = array[pc+1];
-			b = array[pc+2];
-			c = array[pc+3];
-			if (a >= size || b >= size || c >= size)
-			{
-				fprintf(stderr, "out of bounds\n");
-			}
-			else
-			{
-				array[c] = array[a] * array[b];
-			}
-			break;
-
-		case OP_HALT:
-			return;
-
-		default:
-			fprintf(stderr, "Unkown opcode %d\n", array[pc]);
-			return;
-		}
-		pc += 4;
-	}
-}
+#include "intcode.h"
 
 int main(int argc, char *argv[])
 {
@@ -72,49 +22,52 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	int *array = NULL;
 	size_t acount = 0;
-	size_t asize = 0;
-
-	int value;
-	while (fscanf(input, "%d,", &value) == 1)
+	int64_t *array = program_load(input, &acount);
+	fclose(input);
+	if (!array)
 	{
-		if (acount == asize)
-		{
-			size_t newsize = asize ? asize * 2 : 32;
-			int *newarray = realloc(array, newsize * sizeof(*newarray));
-			if (!newarray)
-			{
-				abort();
-			}
-			asize = newsize;
-			array = newarray;
-		}
-		array[acount++] = value;
+		fprintf(stderr, "Cannot load the intcode program\n");
+		return -1;
 	}
-	fclose(input);
 
-	int *test = malloc(acount * sizeof(*test));
-	if (!test)
+	struct module *m = module_new();
+	if (!m)
 	{
 		abort();
 	}
-	memcpy(test, array, acount * sizeof(*test));
-	test[1] = 12;
-	test[2] = 2;
-	execute(test, acount);
-	printf("part 1: %d\n", test[0]);
+	module_load(m, array, acount);
+	module_poke(m, 1, 12);
+	module_poke(m, 2, 2);
+	module_execute(m);
+	printf("part 1: %" PRId64 "\n", module_peek(m, 0));
+
+	/* cell 0 as a function of the noun and the verb, NULL if the
+	 * program is not straight-line */
+	int64_t cells[] = { 1, 2 };
+	struct symbolic *s = program_symbolic(array, acount, cells, 2, NULL, 0, 100000);
+	struct expr *e = s ? symbolic_cell(s, 0) : NULL;
+	symbolic_free(s);
 
 	for (int i = 0; i < 100; i++)
 	{
 		for (int j = 0; j < 100; j++)
 		{
-			memcpy(test, array, acount * sizeof(*test));
-			test[1] = i;
-			test[2] = j;
-			execute(test, acount);
+			int64_t value;
+			if (e)
+			{
+				value = expr_eval(e, (int64_t[]){ i, j });
+			}
+			else
+			{
+				module_load(m, array, acount);
+				module_poke(m, 1, i);
+				module_poke(m, 2, j);
+				module_execute(m);
+				value = module_peek(m, 0);
+			}
 
-			if (test[0] == 19690720)
+			if (value == 19690720)
 			{
 				printf("part 2: 100 * %d + %d = %d\n", i, j, i*100+j);
 				i = j = 100;
@@ -123,7 +76,8 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	free(test);
+	expr_free(e);
+	module_free(m);
 	free(array);
 
 	return 0;
@@ -1,298 +1,399 @@
 #include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "intcode.h"
+
+/*
+ * The NICs run on a pool of threads. Each NIC is in the run queue of
+ * at most one worker at a time and the idle workers steal from the
+ * others. The packets are delivered through a lock-free mailbox with
+ * many producers and a single consumer: the worker that runs the NIC.
+ *
+ * The VM itself answers -1 to the reads of an empty queue and stops
+ * with INPUT_IDLE once a NIC read it IDLE_READS times in a row without
+ * sending anything; the NIC is then parked until a packet arrives.
+ *
+ * To keep the answers independent of the scheduling the network runs
+ * in rounds: a NIC reads only the packets sent in the rounds before,
+ * sorted by sender and by the order they were sent, and a packet
+ * wakes its destination for the next round. The NICs of the round are
+ * counted by active; the worker that brings it to zero starts the next
+ * round, or wakes NIC 0 from the NAT when no NIC was woken. The NAT
+ * keeps the last of its packets in the same order. The workers without
+ * a NIC to run sleep until the next round.
+ */
+
+#define NAT 255
+
+/* reads of -1 without output before a NIC is parked */
+#define IDLE_READS 2
 
 enum
 {
-	/* opcodes */
-	OP_ADD	= 1,		/* [c] = [a] + [b]        */
-	OP_MUL	= 2,		/* [c] = [a] * [b]        */
-	OP_IN	= 3,		/* [a] = <input>          */
-	OP_OUT	= 4,		/* output([a])            */
-	OP_JNZ	= 5,		/* if ([a] != 0) goto [b] */
-	OP_JZ	= 6,		/* if ([a] == 0) goto [b] */
-	OP_TLT	= 7,		/* [c] = [a] < [b]        */
-	OP_TEQ	= 8,		/* [c] = [a] == [b]       */
-	OP_ARB  = 9,		/* rbp += [a]             */
-	OP_HALT = 99,
-
-	/* addressing modes */
-	PMODE = 0,		/* absolute index */
-	IMODE = 1,		/* immediate literal */
-	RMODE = 2,		/* relative index (to rbp) */
-
-	/* state of the execution */
-	INPUT_EMPTY = 0,
-	OUTPUT_FULL = 1,
-	HALTED = 2,
+	NIC_IDLE,
+	NIC_QUEUED,
 };
 
-struct module
+/* when a packet was sent, the packets are read in this order */
+struct stamp
 {
-	int64_t *ram;
-	size_t size;
-	int64_t pc;		/* instruction/program counter */
-	int64_t rbp;		/* relative base pointer */
+	uint64_t round;
+	size_t from;		/* the NAT comes after the NICs */
+	size_t seq;		/* packets sent before in the round */
+};
 
-	int64_t inq[32];
-	size_t ri, wi;
+struct message
+{
+	struct stamp t;
+	int64_t x, y;
+};
 
-	int64_t outq[32];
-	size_t ro, wo;
+struct packet
+{
+	_Atomic(struct packet *) next;
+	struct message msg;
+};
 
-	FILE *output;
+/* Vyukov's queue, tail is a dummy node already consumed */
+struct mailbox
+{
+	_Atomic(struct packet *) head;
+	struct packet *tail;
 };
 
-static void module_free(struct module *m)
+struct nic
 {
-	if (m)
+	struct module *m;
+	struct mailbox mail;
+	atomic_int state;
+};
+
+struct worker
+{
+	pthread_t thread;
+	struct network *net;
+	pthread_mutex_t lock;
+	int *queue;		/* ring of the runnable NICs */
+	size_t r, w;
+
+	int *next;		/* NICs woken for the next round */
+	size_t nnext;
+	struct message *inbox;	/* packets read by a NIC */
+	size_t isize;
+};
+
+struct network
+{
+	struct nic *nic;
+	size_t count;
+	size_t qsize;		/* power of two >= count */
+
+	struct worker *worker;
+	size_t nworkers;
+
+	atomic_size_t active;	/* NICs of the round still to run */
+	atomic_int done;
+	_Atomic uint64_t round;
+	pthread_mutex_t lock;	/* the workers sleep on wake */
+	pthread_cond_t wake;
+
+	pthread_mutex_t nat_lock;
+	int nat_ready;
+	struct stamp first, last;
+	int64_t natx, naty, lasty;
+	int64_t part1, part2;
+};
+
+static int stamp_cmp(const struct stamp *a, const struct stamp *b)
+{
+	if (a->round != b->round)
+	{
+		return a->round < b->round ? -1 : 1;
+	}
+	if (a->from != b->from)
 	{
-		free(m->ram);
-		free(m);
+		return a->from < b->from ? -1 : 1;
 	}
+	return a->seq < b->seq ? -1 : a->seq > b->seq;
 }
 
-static struct module *module_new(void)
+static int message_cmp(const void *a, const void *b)
 {
-	return 	calloc(1, sizeof(struct module));
+	return stamp_cmp(&((const struct message *)a)->t,
+			 &((const struct message *)b)->t);
 }
 
-static int64_t address_of(struct module *m, int64_t pos, int mode)
+static void mailbox_init(struct mailbox *mb)
 {
-	while ((size_t)pos >= m->size)
-	{
-		size_t nsize = m->size ? m->size * 2 : 1024;
-		int64_t *nram = realloc(m->ram, nsize * sizeof(*nram));
-		assert(nram);
+	struct packet *stub = calloc(1, sizeof(*stub));
+	assert(stub);
+	atomic_init(&stub->next, NULL);
+	atomic_init(&mb->head, stub);
+	mb->tail = stub;
+}
 
-		/* NOTE: realloc() doesn't guarantee that the added
-		 * memory is zeroed. */
-		memset(nram+m->size, 0, nsize - m->size);
-		m->size = nsize;
-		m->ram = nram;
-	}
+static void mailbox_push(struct mailbox *mb, struct packet *p)
+{
+	atomic_store_explicit(&p->next, NULL, memory_order_relaxed);
+	struct packet *prev = atomic_exchange(&mb->head, p);
+	atomic_store(&prev->next, p);
+}
 
-	switch(mode)
+/*
+ * consumer side, returns 0 if the mailbox has no packet sent before
+ * round; the packets of a round are all pushed before the next one
+ * starts, so the older ones come first
+ */
+static int mailbox_pop(struct mailbox *mb, uint64_t round, struct message *msg)
+{
+	struct packet *tail = mb->tail;
+	struct packet *next = atomic_load(&tail->next);
+	if (!next || next->msg.t.round >= round)
 	{
-	case IMODE: return pos;
-	case PMODE: return address_of(m, m->ram[pos], IMODE);
-	case RMODE: return address_of(m, m->rbp + m->ram[pos], IMODE);
-	default:
-		fprintf(stderr, "Unknown addressing mode: %d\n", mode);
-		abort();
+		return 0;
 	}
+	*msg = next->msg;
+	mb->tail = next;
+	free(tail);
+	return 1;
 }
 
-static void module_load(struct module *m, const int64_t *prog, size_t psize)
+static int mailbox_empty(struct mailbox *mb)
 {
-	/* NOTE: forces a reallocation */
-	address_of(m, psize, IMODE);
-
-	/* reset the memory and copy the program */
-	memcpy(m->ram, prog, psize * sizeof(m->ram[0]));
-	memset(m->ram+psize, 0, (m->size - psize) * sizeof(m->ram[0]));
-
-	m->pc = 0;
-	m->rbp = 0;
-	m->ri = m->wi = m->ro = m->wo = 0;
+	return atomic_load(&mb->tail->next) == NULL;
 }
 
-static void module_push_input(struct module *m, int64_t value)
+static void mailbox_free(struct mailbox *mb)
 {
-	assert(m->wi - m->ri < 32);
-	m->inq[(m->wi++) & 31] = value;
+	struct message msg;
+	while (mailbox_pop(mb, UINT64_MAX, &msg))
+	{
+	}
+	free(mb->tail);
 }
 
-static int module_input_full(struct module *m)
+static void worker_push(struct worker *w, int id)
 {
-	return m->ri + 32 == m->wi;
+	pthread_mutex_lock(&w->lock);
+	w->queue[w->w++ & (w->net->qsize - 1)] = id;
+	pthread_mutex_unlock(&w->lock);
 }
 
-static int64_t module_pop_output(struct module *m)
+/* the owner takes from the back, the thieves from the front */
+static int worker_pop(struct worker *w, int steal)
 {
-	assert(m->wo != m->ro);
-	return m->outq[(m->ro++) & 31];
+	int id = -1;
+	pthread_mutex_lock(&w->lock);
+	if (w->r != w->w)
+	{
+		id = steal
+			? w->queue[w->r++ & (w->net->qsize - 1)]
+			: w->queue[--w->w & (w->net->qsize - 1)];
+	}
+	pthread_mutex_unlock(&w->lock);
+	return id;
 }
 
-static int module_output_empty(struct module *m)
+static int worker_next(struct worker *w)
 {
-	return m->ro == m->wo;
+	int id = worker_pop(w, 0);
+	size_t self = w - w->net->worker;
+	for (size_t k = 1; id < 0 && k < w->net->nworkers; k++)
+	{
+		id = worker_pop(w->net->worker + (self + k) % w->net->nworkers, 1);
+	}
+	return id;
 }
 
-static int module_output_len(struct module *m)
+/* the destination runs in the next round if it was parked */
+static void network_send(struct worker *w, int dst, const struct message *msg)
 {
-	return m->wo - m->ro;
+	struct network *net = w->net;
+	struct packet *p = malloc(sizeof(*p));
+	assert(p);
+	p->msg = *msg;
+	mailbox_push(&net->nic[dst].mail, p);
+	if (atomic_exchange(&net->nic[dst].state, NIC_QUEUED) == NIC_IDLE)
+	{
+		w->next[w->nnext++] = dst;
+	}
 }
 
-static void module_log(struct module *m, FILE *out)
+static void network_nat(struct worker *w, const struct message *msg)
 {
-	m->output = out;
+	struct network *net = w->net;
+	pthread_mutex_lock(&net->nat_lock);
+	if (!net->nat_ready || stamp_cmp(&msg->t, &net->first) < 0)
+	{
+		net->first = msg->t;
+		net->part1 = msg->y;
+	}
+	if (!net->nat_ready || stamp_cmp(&msg->t, &net->last) > 0)
+	{
+		net->last = msg->t;
+		net->natx = msg->x;
+		net->naty = msg->y;
+	}
+	net->nat_ready = 1;
+	pthread_mutex_unlock(&net->nat_lock);
 }
 
-static int module_execute(struct module *m)
+/*
+ * the NICs of the round are parked, only one worker gets here: the
+ * NICs woken during the round are queued for the next one, or NIC 0
+ * if the network is idle
+ */
+static void network_round(struct worker *w)
 {
-	for (;;)
-	{
-		int op;
-		div_t d = div(m->ram[m->pc], 100);
-		op = d.rem;
-		d = div(d.quot, 10);
-		int a_mode = d.rem;
-		d = div(d.quot, 10);
-		int b_mode = d.rem;
-		d = div(d.quot, 10);
-		int c_mode = d.rem;
-
-		int64_t a, b, c;
-		switch (op)
+	struct network *net = w->net;
+	uint64_t round = atomic_load(&net->round);
+	size_t count = 0;
+	for (size_t k = 0; k < net->nworkers; k++)
+	{
+		count += net->worker[k].nnext;
+	}
+
+	pthread_mutex_lock(&net->lock);
+	if (count == 0 && (!net->nat_ready || net->naty == net->lasty))
+	{
+		net->part2 = net->nat_ready ? net->naty : INT64_MAX;
+		atomic_store(&net->done, 1);
+		pthread_cond_broadcast(&net->wake);
+		pthread_mutex_unlock(&net->lock);
+		return;
+	}
+	if (count == 0)
+	{
+		struct message msg = {
+			.t = { .round = round, .from = net->count },
+			.x = net->natx,
+			.y = net->naty,
+		};
+		net->lasty = net->naty;
+		network_send(w, 0, &msg);
+		count = 1;
+	}
+
+	/* NOTE: the workers that are still awake may take a NIC as
+	 * soon as it is queued */
+	atomic_store(&net->round, round + 1);
+	atomic_store(&net->active, count);
+	for (size_t k = 0; k < net->nworkers; k++)
+	{
+		struct worker *o = net->worker + k;
+		pthread_mutex_lock(&o->lock);
+		for (size_t i = 0; i < o->nnext; i++)
 		{
-		case OP_ADD:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode != IMODE);
-			m->ram[c] = m->ram[a] + m->ram[b];
-			m->pc += 4;
-			break;
-
-		case OP_MUL:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode != IMODE);
-			m->ram[c] = m->ram[a] * m->ram[b];
-			m->pc += 4;
-			break;
-
-		case OP_IN:
-			a = address_of(m, m->pc+1, a_mode);
-			assert(a_mode != IMODE);
-			if (m->wi == m->ri)
-			{
-				return INPUT_EMPTY;
-			}
-			m->ram[a] = m->inq[(m->ri++) & 31];
-			m->pc += 2;
-			if  (m->output && 0 <= m->ram[a] && m->ram[a] < 256)
-			{
-				putc(m->ram[a], m->output);
-			}
-			break;
-
-		case OP_OUT:
-			a = address_of(m, m->pc+1, a_mode);
-			if (m->wo - m->ro == 32)
-			{
-				return OUTPUT_FULL;
-			}
-			m->outq[(m->wo++) & 31] = m->ram[a];
-			m->pc += 2;
-			if  (m->output && 0 <= m->ram[a] && m->ram[a] < 256)
-			{
-				putc(m->ram[a], m->output);
-			}
-			break;
-
-		case OP_JNZ:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			if (m->ram[a] != 0)
-			{
-				m->pc = m->ram[b];
-			}
-			else
-			{
-				m->pc += 3;
-			}
-			break;
-
-		case OP_JZ:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			if (m->ram[a] == 0)
-			{
-				m->pc = m->ram[b];
-			}
-			else
-			{
-				m->pc += 3;
-			}
-			break;
-
-		case OP_TLT:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode != IMODE);
-			m->ram[c] = m->ram[a] < m->ram[b] ? 1 : 0;
-			m->pc += 4;
-			break;
-
-		case OP_TEQ:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode != IMODE);
-			m->ram[c] = m->ram[a] == m->ram[b] ? 1 : 0;
-			m->pc += 4;
-			break;
-
-		case OP_ARB:
-			a = address_of(m, m->pc+1, a_mode);
-			m->rbp += m->ram[a];
-			m->pc += 2;
-			break;
-
-		case OP_HALT:
-			return HALTED;
-
-		default:
-			fprintf(stderr, "Unknown opcode %" SCNd64 " at %" SCNd64 "\n",
-				m->ram[m->pc], m->pc);
-			abort();
+			o->queue[o->w++ & (net->qsize - 1)] = o->next[i];
 		}
+		pthread_mutex_unlock(&o->lock);
+		o->nnext = 0;
 	}
+	pthread_cond_broadcast(&net->wake);
+	pthread_mutex_unlock(&net->lock);
 }
 
-static int64_t *program_load(FILE *input, size_t *count)
+static void nic_run(struct worker *w, int id)
 {
-	int64_t *array = NULL;
-	size_t acount = 0;
-	size_t asize = 0;
+	struct network *net = w->net;
+	struct nic *nic = net->nic + id;
+	uint64_t round = atomic_load(&net->round);
+
+	size_t n = 0;
+	struct message msg;
+	while (mailbox_pop(&nic->mail, round, &msg))
+	{
+		if (n == w->isize)
+		{
+			w->isize = w->isize ? w->isize * 2 : 64;
+			w->inbox = realloc(w->inbox, w->isize * sizeof(*w->inbox));
+			assert(w->inbox);
+		}
+		w->inbox[n++] = msg;
+	}
+	if (n > 1)
+	{
+		qsort(w->inbox, n, sizeof(*w->inbox), message_cmp);
+	}
+	for (size_t k = 0; k < n; k++)
+	{
+		int64_t packet[2] = { w->inbox[k].x, w->inbox[k].y };
+		module_push_inputs(nic->m, packet, 2);
+	}
 
-	int64_t value;
-	while (fscanf(input, "%" SCNd64 ",", &value) == 1)
+	/* NOTE: a halted NIC is parked forever */
+	module_execute(nic->m);
+	int64_t out[3];
+	msg.t = (struct stamp){ .round = round, .from = id };
+	for (; module_output_len(nic->m) >= 3; msg.t.seq++)
 	{
-		if (acount == asize)
+		module_pop_outputs(nic->m, out, 3);
+		msg.x = out[1];
+		msg.y = out[2];
+		/* NOTE: with more than 255 NICs the NAT still
+		 * takes the packets sent to 255 */
+		if (out[0] == NAT)
 		{
-			size_t newsize = asize ? asize * 2 : 32;
-			int64_t *newarray = realloc(array, newsize * sizeof(*newarray));
-			if (!newarray)
-			{
-				free(array);
-				return NULL;
-			}
-			asize = newsize;
-			array = newarray;
+			network_nat(w, &msg);
 		}
-		array[acount++] = value;
+		else if (0 <= out[0] && (size_t)out[0] < net->count)
+		{
+			network_send(w, out[0], &msg);
+		}
+	}
+
+	/* park the NIC, unless a packet arrived meanwhile and its
+	 * sender didn't see the NIC idle */
+	atomic_store(&nic->state, NIC_IDLE);
+	if (!mailbox_empty(&nic->mail) &&
+	    atomic_exchange(&nic->state, NIC_QUEUED) == NIC_IDLE)
+	{
+		w->next[w->nnext++] = id;
+	}
+	if (atomic_fetch_sub(&net->active, 1) == 1)
+	{
+		network_round(w);
 	}
-	*count = acount;
-	return array;
 }
 
-int main(int argc, char *argv[])
+static void *worker_main(void *arg)
 {
-	(void)module_input_full;
-	(void)module_output_empty;
-	(void)module_log;
+	struct worker *w = arg;
+	struct network *net = w->net;
+	uint64_t round = 0;
+	while (!atomic_load(&net->done))
+	{
+		int id = worker_next(w);
+		if (id >= 0)
+		{
+			nic_run(w, id);
+			continue;
+		}
+
+		/* NOTE: no NIC is queued until the next round */
+		pthread_mutex_lock(&net->lock);
+		while (!atomic_load(&net->done) && atomic_load(&net->round) == round)
+		{
+			pthread_cond_wait(&net->wake, &net->lock);
+		}
+		round = atomic_load(&net->round);
+		pthread_mutex_unlock(&net->lock);
+	}
+	return NULL;
+}
 
+int main(int argc, char *argv[])
+{
 	if (argc < 2)
 	{
-		fprintf(stderr, "Usage: %s <input>\n", argv[0]);
+		fprintf(stderr, "Usage: %s <input> [nics] [threads]\n", argv[0]);
 		return -1;
 	}
 
@@ -312,71 +413,98 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	struct module *comp[50];
-	for (int i = 0; i < 50; i++)
+	struct network net = {
+		.count = argc > 2 ? strtoul(argv[2], NULL, 10) : 50,
+		.nworkers = argc > 3 ? strtoul(argv[3], NULL, 10) : 0,
+		.lasty = INT64_MAX,
+	};
+	if (net.count == 0 || net.count > INT32_MAX)
 	{
-		comp[i] = module_new();
-		module_load(comp[i], program, pcount);
-		module_push_input(comp[i], i);
+		fprintf(stderr, "Invalid number of NICs %zu\n", net.count);
+		return -1;
 	}
+	if (net.nworkers == 0)
+	{
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		net.nworkers = n > 0 ? n : 1;
+	}
+	for (net.qsize = 1; net.qsize < net.count; net.qsize *= 2)
+	{
+	}
+
+	net.nic = calloc(net.count, sizeof(*net.nic));
+	net.worker = calloc(net.nworkers, sizeof(*net.worker));
+	assert(net.nic && net.worker);
+	pthread_mutex_init(&net.nat_lock, NULL);
+	pthread_mutex_init(&net.lock, NULL);
+	pthread_cond_init(&net.wake, NULL);
+	for (size_t i = 0; i < net.nworkers; i++)
+	{
+		struct worker *w = net.worker + i;
+		w->net = &net;
+		w->queue = malloc(net.qsize * sizeof(*w->queue));
+		w->next = malloc(net.count * sizeof(*w->next));
+		assert(w->queue && w->next);
+		pthread_mutex_init(&w->lock, NULL);
+	}
+
+	/* every NIC starts in a run queue to read its address; they
+	 * share the decoded program until they write it */
+	struct image *img = image_new(program, pcount);
+	assert(img);
+	atomic_init(&net.active, net.count);
+	atomic_init(&net.done, 0);
+	atomic_init(&net.round, 0);
+	for (size_t i = 0; i < net.count; i++)
+	{
+		struct nic *nic = net.nic + i;
+		nic->m = module_new();
+		assert(nic->m);
+		module_load_image(nic->m, img);
+		module_idle_input(nic->m, -1, IDLE_READS);
+		module_push_input(nic->m, i);
+		mailbox_init(&nic->mail);
+		atomic_init(&nic->state, NIC_QUEUED);
+		worker_push(net.worker + i % net.nworkers, i);
+	}
+	image_free(img);
 	free(program);
 
-	int64_t natx = INT64_MAX;
-	int64_t naty = INT64_MAX;
-	int64_t lasty = INT64_MAX;
-	int last_running = -1;
-	int i = 0;
-	for (;;)
+	for (size_t i = 0; i < net.nworkers; i++)
 	{
-		struct module *c = comp[i];
-		module_execute(c);
-		if (module_output_len(c) >= 3)
-		{
-			last_running = i;
-			int dst = module_pop_output(c);
-			int64_t x = module_pop_output(c);
-			int64_t y = module_pop_output(c);
-			if (dst == 255)
-			{
-				if (naty == INT64_MAX)
-				{
-					printf("part1: %ld\n", y);
-				}
-				natx = x;
-				naty = y;
-				i = (i + 1) % 50;
-			}
-			else
-			{
-				last_running = -1;
-				i = dst;
-				module_push_input(comp[i], x);
-				module_push_input(comp[i], y);
-			}
-		}
-		else
-		{
-			module_push_input(c, -1);
-			i = (i + 1) % 50;
-		}
+		pthread_create(&net.worker[i].thread, NULL, worker_main, net.worker + i);
+	}
+	for (size_t i = 0; i < net.nworkers; i++)
+	{
+		pthread_join(net.worker[i].thread, NULL);
+	}
 
-		if (i == last_running)
-		{
-			if (lasty == naty)
-			{
-				printf("part2: %ld\n", naty);
-				break;
-			}
-			lasty = naty;
-			i = 0;
-			module_push_input(comp[i], natx);
-			module_push_input(comp[i], naty);
-		}
+	if (net.part2 == INT64_MAX)
+	{
+		fprintf(stderr, "The network is idle and the NAT is empty\n");
+	}
+	else
+	{
+		printf("part1: %" PRId64 "\n", net.part1);
+		printf("part2: %" PRId64 "\n", net.part2);
 	}
 
-	for (i = 0; i < 50; i++)
+	for (size_t i = 0; i < net.nworkers; i++)
+	{
+		pthread_mutex_destroy(&net.worker[i].lock);
+		free(net.worker[i].queue);
+		free(net.worker[i].next);
+		free(net.worker[i].inbox);
+	}
+	for (size_t i = 0; i < net.count; i++)
 	{
-		module_free(comp[i]);
+		mailbox_free(&net.nic[i].mail);
+		module_free(net.nic[i].m);
 	}
-	return 0;
+	pthread_mutex_destroy(&net.nat_lock);
+	pthread_mutex_destroy(&net.lock);
+	pthread_cond_destroy(&net.wake);
+	free(net.worker);
+	free(net.nic);
+	return net.part2 == INT64_MAX ? -1 : 0;
 }
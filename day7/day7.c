@@ -1,260 +1,377 @@
 #include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "intcode.h"
 #include "perm.h"
 
-enum
+static int64_t signal(struct module **m, const int64_t *program, size_t pcount,
+		      const int *sarr, size_t count)
 {
-	OP_ADD	= 1,
-	OP_MUL	= 2,
-	OP_IN	= 3,
-	OP_OUT	= 4,
-	OP_JNZ	= 5,
-	OP_JZ	= 6,
-	OP_TLT	= 7,
-	OP_TEQ	= 8,
-	OP_HALT = 99,
-
-	PMODE = 0,
-	IMODE = 1,
-
-	INPUT_EMPTY = 0,
-	OUTPUT_FULL = 1,
-	HALTED = 2,
-};
-
-struct module
-{
-	int *ram;
-	size_t size;
-	int pc;
+	/* the amplifier i writes into the channel c[i] that the next
+	 * one reads */
+	struct channel **c = calloc(count, sizeof(*c));
+	assert(c);
+	for (size_t i = 0; i < count; i++)
+	{
+		c[i] = channel_new();
+		assert(c[i]);
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		module_load(m[i], program, pcount);
+		module_push_input(m[i], sarr[i]);
+		module_connect(m[i], c[i], m[(i + 1) % count]);
+	}
+	channel_push(c[count - 1], 0);
 
-	int inq[32];
-	unsigned ri, wi;
+	int exit;
+	do
+	{
+		exit = 1;
+		for (size_t i = 0; i < count; i++)
+		{
+			exit &= module_execute(m[i]) == HALTED;
+		}
+	} while(!exit);
 
-	int outq[32];
-	unsigned ro, wo;
-};
+	/* the last value sent back to the first amplifier, which
+	 * halted before reading it */
+	int64_t result = 0;
+	while (channel_len(c[count - 1]))
+	{
+		result = channel_pop(c[count - 1]);
+	}
 
-static void module_free(struct module *m)
-{
-	if (m)
+	for (size_t i = 0; i < count; i++)
 	{
-		free(m->ram);
-		free(m);
+		module_connect(m[i], NULL, NULL);
+		channel_free(c[i]);
 	}
+	free(c);
+	return result;
 }
 
-static struct module *module_new(const int *ram, size_t size)
+/*
+ * Chain without feedback: when the amplifiers halt after one output,
+ * the output of the amplifier k depends only on the phases of the
+ * amplifiers 0..k. out[k] keeps it for the current prefix and only
+ * the amplifiers after the first *len phases run again, *len is then
+ * the number of outputs that can be reused. The chain falls back to
+ * signal() when an amplifier does not halt.
+ */
+static int64_t signal_chain(struct module **m, const int64_t *program,
+			    size_t pcount, const int *sarr, size_t count,
+			    int64_t *out, size_t *len)
 {
-	struct module *m = calloc(1, sizeof(*m));
-	if (m)
+	for (size_t i = *len; i < count; i++)
 	{
-		if (ram && size)
+		module_load(m[i], program, pcount);
+		module_push_input(m[i], sarr[i]);
+		module_push_input(m[i], i ? out[i - 1] : 0);
+		if (module_execute(m[i]) != HALTED)
 		{
-			m->ram = malloc(size * sizeof(*ram));
-			memcpy(m->ram, ram, size * sizeof(*ram));
+			*len = i;
+			return signal(m, program, pcount, sarr, count);
 		}
-		m->size = size;
-		m->pc = 0;
+		out[i] = module_pop_output(m[i]);
 	}
-	return m;
+	*len = count;
+	return out[count - 1];
 }
 
-static void module_reset(struct module *m, const int *ram, size_t size)
+/*
+ * Pipelined feedback loop: every amplifier runs on its own thread
+ * until it halts, the values go from an amplifier to the next one
+ * through a lock-free queue with a single producer and a single
+ * consumer that the I/O callbacks of the modules push and pop. The
+ * queue is a list of chunks that grows like the channels of signal(),
+ * an amplifier never waits to write: they may all write many values
+ * before any of them reads.
+ */
+#define CHUNK_SIZE 64
+
+struct chunk
 {
-	int *newarr = realloc(m->ram, size * sizeof(*m->ram));
-	if (newarr)
+	_Atomic(struct chunk *) next;
+	int64_t buf[CHUNK_SIZE];
+};
+
+struct queue
+{
+	struct chunk *head;	/* read by the consumer */
+	struct chunk *tail;	/* written by the producer */
+	size_t r;		/* only the consumer reads it */
+	_Atomic size_t w;
+};
+
+struct stage
+{
+	struct module *m;
+	struct queue in;	/* written by the previous stage */
+	struct stage *next;
+	struct stage *prev;
+	atomic_int done;
+	int64_t last;		/* last value sent to the next stage */
+	pthread_t thread;
+};
+
+static void queue_init(struct queue *q)
+{
+	q->head = q->tail = calloc(1, sizeof(*q->head));
+	assert(q->head);
+	q->r = 0;
+	atomic_init(&q->w, 0);
+}
+
+static void queue_free(struct queue *q)
+{
+	while (q->head)
 	{
-		m->ram = newarr;
-		m->size = size;
-		memcpy(m->ram, ram, size * sizeof(*ram));
-		m->pc = m->ri = m->wi = m->ro = m->wo = 0;
+		struct chunk *next = atomic_load_explicit(&q->head->next, memory_order_relaxed);
+		free(q->head);
+		q->head = next;
 	}
 }
 
-static void module_push_input(struct module *m, int value)
+static void queue_push(struct queue *q, int64_t value)
 {
-	m->inq[(m->wi++)&31] = value;
+	size_t w = atomic_load_explicit(&q->w, memory_order_relaxed);
+	if (w && w % CHUNK_SIZE == 0)
+	{
+		/* NOTE: linked before w is published, the consumer
+		 * follows it once it read the whole tail */
+		struct chunk *c = calloc(1, sizeof(*c));
+		assert(c);
+		atomic_store_explicit(&q->tail->next, c, memory_order_relaxed);
+		q->tail = c;
+	}
+	q->tail->buf[w % CHUNK_SIZE] = value;
+	atomic_store_explicit(&q->w, w + 1, memory_order_release);
 }
 
-static int module_input_full(struct module *m)
+/* returns 0 if the queue is empty */
+static int queue_pop(struct queue *q, int64_t *value)
 {
-	return m->ri + 32 == m->wi;
+	size_t r = q->r;
+	if (r == atomic_load_explicit(&q->w, memory_order_acquire))
+	{
+		return 0;
+	}
+	if (r && r % CHUNK_SIZE == 0)
+	{
+		struct chunk *next = atomic_load_explicit(&q->head->next, memory_order_relaxed);
+		free(q->head);
+		q->head = next;
+	}
+	*value = q->head->buf[r % CHUNK_SIZE];
+	q->r = r + 1;
+	return 1;
+}
+
+static int stage_input(void *ctx, int64_t *value)
+{
+	struct stage *s = ctx;
+	while (!queue_pop(&s->in, value))
+	{
+		/* NOTE: the previous stage might have pushed
+		 * before it halted */
+		if (atomic_load_explicit(&s->prev->done, memory_order_acquire))
+		{
+			return queue_pop(&s->in, value);
+		}
+		sched_yield();
+	}
+	return 1;
 }
 
-static int module_pop_output(struct module *m)
+static void stage_output(void *ctx, int64_t value)
 {
-	return m->outq[(m->ro++)&31];
+	struct stage *s = ctx;
+	s->last = value;
+	queue_push(&s->next->in, value);
 }
 
-static int module_output_empty(struct module *m)
+static void *stage_run(void *arg)
 {
-	return m->ro == m->wo;
+	struct stage *s = arg;
+	module_execute(s->m);
+	atomic_store_explicit(&s->done, 1, memory_order_release);
+	return NULL;
 }
 
-static int address_of(struct module *m, int pos, int mode)
+static int64_t signal_pipelined(struct module **m, const int64_t *program,
+				size_t pcount, const int *sarr, size_t count)
 {
-	assert(pos >= 0 && (size_t)pos < m->size);
-	if (mode == PMODE)
+	struct stage *s = calloc(count, sizeof(*s));
+	assert(s);
+	for (size_t i = 0; i < count; i++)
+	{
+		s[i].m = m[i];
+		s[i].next = s + (i + 1) % count;
+		s[i].prev = s + (i + count - 1) % count;
+		queue_init(&s[i].in);
+		module_load(m[i], program, pcount);
+		module_push_input(m[i], sarr[i]);
+		module_io(m[i], stage_input, stage_output, s + i);
+	}
+	queue_push(&s[0].in, 0);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		int r = pthread_create(&s[i].thread, NULL, stage_run, s + i);
+		assert(r == 0);
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		pthread_join(s[i].thread, NULL);
+		module_io(m[i], NULL, NULL, NULL);
+	}
+	for (size_t i = 0; i < count; i++)
 	{
-		pos = address_of(m, m->ram[pos], IMODE);
+		queue_free(&s[i].in);
 	}
-	return pos;
+
+	/* the last value sent back to the first amplifier */
+	int64_t result = s[count - 1].last;
+	free(s);
+	return result;
 }
 
-static int module_execute(struct module *m)
+/*
+ * The permutations of the phases are split in contiguous ranges of
+ * their lexicographic order, one for each worker; every worker owns
+ * the modules of a chain and keeps its own maximum, the maximum of
+ * the workers is taken after they are joined.
+ */
+enum mode
 {
-	for (;;)
-	{
-		int op, a, b, c;
-		div_t d = div(m->ram[m->pc], 100);
-		op = d.rem;
-		d = div(d.quot, 10);
-		int a_mode = d.rem;
-		d = div(d.quot, 10);
-		int b_mode = d.rem;
-		d = div(d.quot, 10);
-		int c_mode = d.rem;
-
-		switch (op)
-		{
-		case OP_ADD:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode == PMODE);
-			m->ram[c] = m->ram[a] + m->ram[b];
-			m->pc += 4;
-			break;
+	FEEDBACK,		/* signal() */
+	PIPELINED,		/* signal_pipelined() */
+	CHAIN,			/* signal_chain(), no feedback */
+};
 
-		case OP_MUL:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode == PMODE);
-			m->ram[c] = m->ram[a] * m->ram[b];
-			m->pc += 4;
-			break;
+struct search
+{
+	const int64_t *program;
+	size_t pcount;
+	const int *phases;	/* sorted */
+	size_t count;
 
-		case OP_IN:
-			if (m->ri == m->wi)
-			{
-				return INPUT_EMPTY;
-			}
-			a = address_of(m, m->pc+1, a_mode);
-			assert(a_mode == PMODE);
-			m->ram[a] = m->inq[(m->ri++)&31];
-			m->pc += 2;
-			break;
+	size_t first;		/* range of permutations */
+	size_t last;
+	enum mode mode;
+	int64_t maxv;
 
-		case OP_OUT:
-			if (m->ro+32 == m->wo)
-			{
-				return OUTPUT_FULL;
-			}
-			a = address_of(m, m->pc+1, a_mode);
-			m->pc += 2;
-			m->outq[(m->wo++)&31] = m->ram[a];
-			break;
-
-		case OP_JNZ:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			if (m->ram[a] != 0)
-			{
-				m->pc = m->ram[b];
-			}
-			else
-			{
-				m->pc += 3;
-			}
-			break;
+	pthread_t thread;
+};
 
-		case OP_JZ:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			if (m->ram[a] == 0)
-			{
-				m->pc = m->ram[b];
-			}
-			else
-			{
-				m->pc += 3;
-			}
-			break;
+static void *search_range(void *arg)
+{
+	struct search *s = arg;
+	struct module **m = calloc(s->count, sizeof(*m));
+	int *sarr = calloc(s->count, sizeof(*sarr));
+	int64_t *out = calloc(s->count, sizeof(*out));
+	assert(m && sarr && out);
+	for (size_t i = 0; i < s->count; i++)
+	{
+		m[i] = module_new();
+		assert(m[i]);
+	}
 
-		case OP_TLT:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode == PMODE);
-			m->ram[c] = m->ram[a] < m->ram[b] ? 1 : 0;
-			m->pc += 4;
+	s->maxv = 0;
+	perm_nth(s->phases, s->count, s->first, sarr);
+	size_t len = 0;		/* phases of out[] still valid */
+	for (size_t k = s->first; k < s->last; k++)
+	{
+		int64_t v;
+		switch (s->mode)
+		{
+		case PIPELINED:
+			v = signal_pipelined(m, s->program, s->pcount, sarr, s->count);
 			break;
-
-		case OP_TEQ:
-			a = address_of(m, m->pc+1, a_mode);
-			b = address_of(m, m->pc+2, b_mode);
-			c = address_of(m, m->pc+3, c_mode);
-			assert(c_mode == PMODE);
-			m->ram[c] = m->ram[a] == m->ram[b] ? 1 : 0;
-			m->pc += 4;
+		case CHAIN:
+			v = signal_chain(m, s->program, s->pcount, sarr, s->count,
+					 out, &len);
 			break;
-
-		case OP_HALT:
-			return HALTED;
-
 		default:
-			fprintf(stderr, "Unknown opcode %d at %d\n", m->ram[m->pc], m->pc);
-			abort();
+			v = signal(m, s->program, s->pcount, sarr, s->count);
+			break;
+		}
+		if (s->maxv < v)
+		{
+			s->maxv = v;
+		}
+		size_t same = perm_lex_next(sarr, s->count) - 1;
+		if (len > same)
+		{
+			len = same;
 		}
 	}
+
+	for (size_t i = 0; i < s->count; i++)
+	{
+		module_free(m[i]);
+	}
+	free(out);
+	free(sarr);
+	free(m);
+	return NULL;
 }
 
-static int signal(const int *program, size_t pcount, int *sarr, size_t count)
+/* maximum signal of the chains with the phases in any order */
+static int64_t search_max(const int64_t *program, size_t pcount,
+			  const int *phases, size_t count, size_t nthreads,
+			  enum mode mode)
 {
-	struct module *m[5];
-	for (size_t i = 0; i < count; i++)
+	size_t total = perm_count(count);
+	if (nthreads > total)
 	{
-		m[i] = module_new(program, pcount);
-		module_push_input(m[i], sarr[i]);
+		nthreads = total;
 	}
-	module_push_input(m[0], 0);
 
-	int exit;
-	do
+	struct search *s = calloc(nthreads, sizeof(*s));
+	assert(s);
+	for (size_t t = 0; t < nthreads; t++)
 	{
-		exit = 1;
-		for (size_t i = 0; i < count; i++)
-		{
-			exit &= module_execute(m[i]) == HALTED;
-
-			size_t j = (i + 1) % count;
-			module_push_input(m[j], module_pop_output(m[i]));
-		}
-	} while(!exit);
+		s[t] = (struct search){
+			.program = program,
+			.pcount = pcount,
+			.phases = phases,
+			.count = count,
+			.first = total * t / nthreads,
+			.last = total * (t + 1) / nthreads,
+			.mode = mode,
+		};
+		int r = pthread_create(&s[t].thread, NULL, search_range, s + t);
+		assert(r == 0);
+	}
 
-	int result = m[0]->inq[m[0]->ri];
-	for (size_t i = 0; i < count; i++)
+	int64_t maxv = 0;
+	for (size_t t = 0; t < nthreads; t++)
 	{
-		module_free(m[i]);
+		pthread_join(s[t].thread, NULL);
+		if (maxv < s[t].maxv)
+		{
+			maxv = s[t].maxv;
+		}
 	}
-
-	return result;
+	free(s);
+	return maxv;
 }
 
 int main(int argc, char *argv[])
 {
-	(void)module_reset;
-	(void)module_input_full;
-	(void)module_output_empty;
-
 	if (argc < 2)
 	{
-		fprintf(stderr, "Usage: %s <input>\n", argv[0]);
+		fprintf(stderr, "Usage: %s <input> [threads] [pipeline]\n", argv[0]);
 		return -1;
 	}
 
@@ -265,96 +382,87 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	struct module *m[5];
+	for (size_t i = 0; i < 5; i++)
 	{
-		int ram[] = {3,15,3,16,1002,16,10,16,1,16,15,15,4,15,99,0,0};
+		m[i] = module_new();
+		assert(m[i]);
+	}
+
+	{
+		int64_t ram[] = {3,15,3,16,1002,16,10,16,1,16,15,15,4,15,99,0,0};
 		int sequence[] = {4, 3, 2, 1, 0};
-		assert(signal(ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 43210);
+		assert(signal(m, ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 43210);
 	}
 
 	{
-		int ram[] = {
+		int64_t ram[] = {
 			3,23,3,24,1002,24,10,24,1002,23,-1,23,
 			101,5,23,23,1,24,23,23,4,23,99,0,0
 		};
 		int sequence[] = {0, 1, 2, 3, 4};
-		assert(signal(ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 54321);
+		assert(signal(m, ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 54321);
 	}
 
 	{
-		int ram[] = {
+		int64_t ram[] = {
 			3,31,3,32,1002,32,10,32,1001,31,-2,31,1007,31,0,33,
 			1002,33,7,33,1,33,31,31,1,32,31,31,4,31,99,0,0,0
 		};
 		int sequence[] = {1, 0, 4, 3, 2};
-		assert(signal(ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 65210);
+		assert(signal(m, ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 65210);
 	}
 
 	{
-		int ram[] = {
+		int64_t ram[] = {
 			3,26,1001,26,-4,26,3,27,1002,27,2,27,1,27,26,
 			27,4,27,1001,28,-1,28,1005,28,6,99,0,0,5
 		};
 		int sequence[] = {9,8,7,6,5};
-		assert(signal(ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 139629729);
+		assert(signal(m, ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 139629729);
+		assert(signal_pipelined(m, ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 139629729);
 	}
 
 	{
-		int ram[] = {
+		int64_t ram[] = {
 			3,52,1001,52,-5,52,3,53,1,52,56,54,1007,54,5,55,1005,55,26,1001,54,
 			-5,54,1105,1,12,1,53,54,53,1008,54,0,55,1001,55,1,55,2,53,55,53,4,
 			53,1001,56,-1,56,1005,56,6,99,0,0,0,0,10
 		};
 		int sequence[] = {9,7,8,5,6};
-		assert(signal(ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 18216);
+		assert(signal(m, ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 18216);
+		assert(signal_pipelined(m, ram, sizeof(ram)/sizeof(ram[0]), sequence, 5) == 18216);
 	}
 
-	int *program = NULL;
-	size_t pcount = 0;
-	size_t psize = 0;
-
-	int value;
-	while (fscanf(input, "%d,", &value) == 1)
+	for (size_t i = 0; i < 5; i++)
 	{
-		if (pcount == psize)
-		{
-			size_t newsize = psize ? psize * 2 : 32;
-			int *newprogram = realloc(program, newsize * sizeof(*newprogram));
-			if (!newprogram)
-			{
-				abort();
-			}
-			psize = newsize;
-			program = newprogram;
-		}
-		program[pcount++] = value;
+		module_free(m[i]);
 	}
-	fclose(input);
 
-	int maxv = 0;
-	for (struct piterator *p = perm_init((int[]){0,1,2,3,4}, 5);
-	     p;
-	     p = perm_next(p))
+	size_t pcount = 0;
+	int64_t *program = program_load(input, &pcount);
+	fclose(input);
+	if (!program)
 	{
-		int s = signal(program, pcount, p->a, p->size);
-		if (maxv < s)
-		{
-			maxv = s;
-		}
+		fprintf(stderr, "Cannot load the intcode program\n");
+		return -1;
 	}
-	printf("part1: %d\n", maxv);
 
-	maxv = 0;
-	for (struct piterator *p = perm_init((int[]){5,6,7,8,9}, 5);
-	     p;
-	     p = perm_next(p))
+	size_t nthreads = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+	int pipeline = argc > 3 ? atoi(argv[3]) : 0;
+	if (nthreads == 0)
 	{
-		int s = signal(program, pcount, p->a, p->size);
-		if (maxv < s)
-		{
-			maxv = s;
-		}
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = n > 0 ? n : 1;
 	}
-	printf("part2: %d\n", maxv);
+
+	int64_t maxv = search_max(program, pcount, (int[]){0,1,2,3,4}, 5, nthreads,
+				  CHAIN);
+	printf("part1: %" PRId64 "\n", maxv);
+
+	maxv = search_max(program, pcount, (int[]){5,6,7,8,9}, 5, nthreads,
+			  pipeline ? PIPELINED : FEEDBACK);
+	printf("part2: %" PRId64 "\n", maxv);
 
 	free(program);
 	return 0;
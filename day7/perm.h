@@ -62,4 +62,75 @@ static inline struct piterator *perm_next(struct piterator *p)
 	return NULL;
 }
 
+/* number of permutations of size elements */
+static inline size_t perm_count(size_t size)
+{
+	size_t n = 1;
+	for (size_t i = 2; i <= size; i++)
+	{
+		n *= i;
+	}
+	return n;
+}
+
+/*
+ * store in out the k-th permutation of the sorted array arr in
+ * lexicographic order, perm_lex_next() continues from there
+ */
+static inline void perm_nth(const int *arr, size_t size, size_t k, int *out)
+{
+	int used[size];
+	memset(used, 0, sizeof(used));
+	size_t f = perm_count(size);
+	for (size_t i = 0; i < size; i++)
+	{
+		f /= size - i;
+		size_t q = k / f;
+		k %= f;
+
+		size_t j = 0;
+		while (used[j] || q--)
+		{
+			j++;
+		}
+		used[j] = 1;
+		out[i] = arr[j];
+	}
+}
+
+/*
+ * next permutation in lexicographic order, returns 0 after the last
+ * or 1 + the number of leading elements that did not change: the
+ * order visits every prefix once, like a depth-first walk of the
+ * trie of the permutations
+ */
+static inline size_t perm_lex_next(int *a, size_t size)
+{
+	size_t i = size;
+	while (i > 1 && a[i - 2] >= a[i - 1])
+	{
+		i--;
+	}
+	if (i <= 1)
+	{
+		return 0;
+	}
+
+	size_t j = size - 1;
+	while (a[j] <= a[i - 2])
+	{
+		j--;
+	}
+	int t = a[i - 2];
+	a[i - 2] = a[j];
+	a[j] = t;
+	for (size_t l = i - 1, r = size - 1; l < r; l++, r--)
+	{
+		t = a[l];
+		a[l] = a[r];
+		a[r] = t;
+	}
+	return i - 1;
+}
+
 #endif
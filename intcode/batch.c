@@ -0,0 +1,619 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intcode.h"
+#include "module.h"
+
+/*
+ * Lockstep execution of many instances of the same program: the
+ * memory keeps the same cell of LANES instances in a vector, so that
+ * one decoded instruction does the work of every lane. The lanes with
+ * the lowest pc form the running group while the others wait for it;
+ * the lanes that diverged join the group again when its pc reaches
+ * theirs.
+ */
+
+/* instances that share a vector of cells */
+#define LANES 4
+
+typedef int64_t vec __attribute__((vector_size(LANES * sizeof(int64_t))));
+
+/* the hot loop is built for AVX2 and for the baseline, the best one is
+ * selected when the program starts */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define BATCH_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define BATCH_CLONES
+#endif
+
+struct batch
+{
+	const int64_t *prog;
+	size_t psize;
+
+	vec *ram;		/* cell a of lane l is ram[a][l] */
+	size_t size;
+	size_t used;		/* cells that might be not zero */
+
+	struct insn *code;	/* decoded instructions valid for all lanes */
+
+	int64_t pc[LANES];	/* of the lanes outside the group */
+	vec rbp;
+	unsigned active;	/* lanes still running */
+	unsigned waiting;	/* lanes stopped at pc on an input */
+
+	const int64_t *in[LANES];
+	size_t nin[LANES];
+
+	int64_t *out[LANES];
+	size_t nout[LANES];
+};
+
+/* lanes that run together */
+struct group
+{
+	int64_t pc;
+	unsigned mask;
+	vec vmask;		/* -1 in the lanes of the group */
+	int lead;		/* first lane of the group */
+	int same_rbp;		/* all the lanes have the same rbp */
+	int64_t next;		/* lowest pc of the other lanes */
+};
+
+static void batch_grow(struct batch *b, int64_t pos)
+{
+	if (pos < 0)
+	{
+		fprintf(stderr, "Invalid address %" PRId64 "\n", pos);
+		abort();
+	}
+
+	size_t nsize = b->size ? b->size : 1024;
+	while ((size_t)pos >= nsize)
+	{
+		nsize *= 2;
+	}
+
+	/* NOTE: realloc() doesn't keep the alignment of the
+	 * vectors */
+	vec *nram = aligned_alloc(sizeof(vec), nsize * sizeof(*nram));
+	if (!nram)
+	{
+		fprintf(stderr, "Cannot grow the memory to %zu cells\n", nsize);
+		abort();
+	}
+	if (b->size)
+	{
+		memcpy(nram, b->ram, b->size * sizeof(*nram));
+	}
+	memset(nram + b->size, 0, (nsize - b->size) * sizeof(*nram));
+	free(b->ram);
+	b->ram = nram;
+	b->size = nsize;
+}
+
+static inline int64_t batch_address(struct batch *b, int64_t pos)
+{
+	if ((uint64_t)pos >= b->size)
+	{
+		batch_grow(b, pos);
+	}
+	return pos;
+}
+
+/* compute what depends on the lanes of the group */
+static void group_update(struct batch *b, struct group *g)
+{
+	g->lead = __builtin_ctz(g->mask);
+	g->same_rbp = 1;
+	for (int l = 0; l < LANES; l++)
+	{
+		g->vmask[l] = g->mask & 1u<<l ? -1 : 0;
+		if ((g->mask & 1u<<l) && b->rbp[l] != b->rbp[g->lead])
+		{
+			g->same_rbp = 0;
+		}
+	}
+}
+
+/* leave the lanes of the group behind and pick the lowest pc */
+static void group_select(struct batch *b, struct group *g)
+{
+	for (int l = 0; l < LANES; l++)
+	{
+		if (g->mask & 1u<<l)
+		{
+			b->pc[l] = g->pc;
+		}
+	}
+
+	g->pc = INT64_MAX;
+	for (int l = 0; l < LANES; l++)
+	{
+		if ((b->active & 1u<<l) && b->pc[l] < g->pc)
+		{
+			g->pc = b->pc[l];
+		}
+	}
+	g->mask = 0;
+	g->next = INT64_MAX;
+	for (int l = 0; l < LANES; l++)
+	{
+		if (!(b->active & 1u<<l))
+		{
+			continue;
+		}
+		else if (b->pc[l] == g->pc)
+		{
+			g->mask |= 1u<<l;
+		}
+		else if (b->pc[l] < g->next)
+		{
+			g->next = b->pc[l];
+		}
+	}
+	if (g->mask)
+	{
+		group_update(b, g);
+	}
+}
+
+/*
+ * fetch the instruction at the pc of the group, the lanes that don't
+ * agree with the first one on its cells are left behind
+ */
+static const struct insn *batch_fetch(struct batch *b, struct group *g, struct insn *tmp)
+{
+	int64_t pc = g->pc;
+	if ((uint64_t)pc < b->psize && b->code[pc].op != INSN_STALE)
+	{
+		return b->code + pc;
+	}
+
+	batch_address(b, pc + 3);
+	int64_t cell[4];
+	for (int k = 0; k < 4; k++)
+	{
+		cell[k] = b->ram[pc + k][g->lead];
+	}
+	insn_decode(tmp, cell, b->size);
+
+	size_t len = tmp->op == INSN_FAULT ? 1 : op_args[tmp->op] + 1;
+	unsigned same = b->active;
+	for (int l = 0; l < LANES; l++)
+	{
+		for (size_t k = 0; k < len; k++)
+		{
+			if (b->ram[pc + k][l] != cell[k])
+			{
+				same &= ~(1u<<l);
+			}
+		}
+	}
+
+	if (g->mask & ~same)
+	{
+		for (int l = 0; l < LANES; l++)
+		{
+			if (g->mask & ~same & 1u<<l)
+			{
+				b->pc[l] = pc;
+			}
+		}
+		g->mask &= same;
+		g->next = pc;
+		group_update(b, g);
+	}
+
+	/* NOTE: the instruction is cached only when all the
+	 * running lanes agree on it */
+	if ((uint64_t)pc < b->psize && same == b->active)
+	{
+		b->code[pc] = *tmp;
+		return b->code + pc;
+	}
+	return tmp;
+}
+
+/* NOTE: the vectors are passed by reference, the helpers are
+ * shared by the builds of batch_run() for every target */
+static inline void batch_load(struct batch *b, const struct group *g, const struct insn *i, int k, vec *v)
+{
+	int64_t arg = i->arg[k];
+	switch (i->kind[k])
+	{
+	case ARG_IMM:
+		*v = (vec){} + arg;
+		break;
+
+	case ARG_ABS:
+		*v = b->ram[arg];
+		break;
+
+	case ARG_REL:
+		/* NOTE: batch_address() can move b->ram */
+		if (g->same_rbp)
+		{
+			int64_t a = batch_address(b, b->rbp[g->lead] + arg);
+			*v = b->ram[a];
+			break;
+		}
+		for (int l = 0; l < LANES; l++)
+		{
+			if (g->mask & 1u<<l)
+			{
+				int64_t a = batch_address(b, b->rbp[l] + arg);
+				(*v)[l] = b->ram[a][l];
+			}
+		}
+		break;
+
+	default:
+		arg = batch_address(b, arg);
+		*v = b->ram[arg];
+		break;
+	}
+}
+
+/* a cell was written, drop what was derived from it */
+static inline void batch_written(struct batch *b, int64_t addr)
+{
+	if ((uint64_t)addr >= b->used)
+	{
+		b->used = addr + 1;
+	}
+	if ((uint64_t)addr < b->psize)
+	{
+		int64_t first = addr >= 3 ? addr - 3 : 0;
+		for (int64_t pc = first; pc <= addr; pc++)
+		{
+			b->code[pc].op = INSN_STALE;
+		}
+	}
+}
+
+/* store the lanes of the group of v into the operand k */
+static inline void batch_store(struct batch *b, const struct group *g, const struct insn *i, int k, const vec *v)
+{
+	int64_t addr = i->arg[k];
+	if (i->kind[k] == ARG_REL)
+	{
+		if (!g->same_rbp)
+		{
+			for (int l = 0; l < LANES; l++)
+			{
+				if (g->mask & 1u<<l)
+				{
+					int64_t a = batch_address(b, b->rbp[l] + addr);
+					b->ram[a][l] = (*v)[l];
+					batch_written(b, a);
+				}
+			}
+			return;
+		}
+		addr += b->rbp[g->lead];
+	}
+
+	addr = batch_address(b, addr);
+	b->ram[addr] = (*v & g->vmask) | (b->ram[addr] & ~g->vmask);
+	batch_written(b, addr);
+}
+
+BATCH_CLONES
+static void batch_run(struct batch *b)
+{
+	struct group g = { .mask = 0 };
+	group_select(b, &g);
+	while (g.mask)
+	{
+		struct insn tmp;
+		const struct insn *i = batch_fetch(b, &g, &tmp);
+		unsigned mask = g.mask;
+		vec x, y;
+		switch (i->op)
+		{
+		case OP_ADD:
+		case OP_MUL:
+		case OP_TLT:
+		case OP_TEQ:
+			batch_load(b, &g, i, 0, &x);
+			batch_load(b, &g, i, 1, &y);
+			switch (i->op)
+			{
+			case OP_ADD: x = x + y; break;
+			case OP_MUL: x = x * y; break;
+			case OP_TLT: x = -(x < y); break;
+			default:     x = -(x == y); break;
+			}
+			batch_store(b, &g, i, 2, &x);
+			g.pc += 4;
+			break;
+
+		case OP_IN:
+			/* NOTE: a lane without input stops */
+			for (int l = 0; l < LANES; l++)
+			{
+				if (!(mask & 1u<<l))
+				{
+					continue;
+				}
+				else if (b->nin[l] == 0)
+				{
+					b->pc[l] = g.pc;
+					b->waiting |= 1u<<l;
+					g.mask &= ~(1u<<l);
+					continue;
+				}
+				int64_t a = i->arg[0];
+				if (i->kind[0] == ARG_REL)
+				{
+					a += b->rbp[l];
+				}
+				a = batch_address(b, a);
+				b->ram[a][l] = *b->in[l]++;
+				b->nin[l]--;
+				batch_written(b, a);
+			}
+			g.pc += 2;
+			break;
+
+		case OP_OUT:
+			/* NOTE: a lane with the outputs full stops */
+			batch_load(b, &g, i, 0, &x);
+			for (int l = 0; l < LANES; l++)
+			{
+				if (!(mask & 1u<<l))
+				{
+					continue;
+				}
+				else if (b->nout[l] == 0)
+				{
+					g.mask &= ~(1u<<l);
+					continue;
+				}
+				*b->out[l]++ = x[l];
+				b->nout[l]--;
+			}
+			g.pc += 2;
+			break;
+
+		case OP_JNZ:
+		case OP_JZ:
+			batch_load(b, &g, i, 0, &x);
+			unsigned taken = 0;
+			for (int l = 0; l < LANES; l++)
+			{
+				if ((mask & 1u<<l) && (x[l] != 0) == (i->op == OP_JNZ))
+				{
+					taken |= 1u<<l;
+				}
+			}
+			if (taken == 0)
+			{
+				g.pc += 3;
+				break;
+			}
+
+			/* NOTE: the lanes that fall through don't read
+			 * the target, it may not be a valid address */
+			struct group t = g;
+			t.mask = taken;
+			batch_load(b, &t, i, 1, &y);
+			unsigned far = 0;
+			for (int l = 0; l < LANES; l++)
+			{
+				if (taken & 1u<<l)
+				{
+					far |= y[l] != y[g.lead] ? 1u<<l : 0;
+				}
+			}
+			if (taken == mask && far == 0)
+			{
+				g.pc = y[g.lead];
+			}
+			else
+			{
+				/* the group splits */
+				for (int l = 0; l < LANES; l++)
+				{
+					if (mask & 1u<<l)
+					{
+						b->pc[l] = taken & 1u<<l ? y[l] : g.pc + 3;
+					}
+				}
+				g.mask = 0;
+			}
+			break;
+
+		case OP_ARB:
+			batch_load(b, &g, i, 0, &x);
+			b->rbp += x & g.vmask;
+			if (i->kind[0] != ARG_IMM)
+			{
+				group_update(b, &g);
+			}
+			g.pc += 2;
+			break;
+
+		case OP_HALT:
+			g.mask = 0;
+			break;
+
+		default:
+			fprintf(stderr, "Invalid instruction %" PRId64 " at %" PRId64 "\n",
+				b->ram[g.pc][g.lead], g.pc);
+			abort();
+		}
+
+		/* the lanes that left the group stopped, unless the
+		 * group split on a jump */
+		if (g.mask != mask)
+		{
+			unsigned parked = 0;
+			if (i->op == OP_JNZ || i->op == OP_JZ)
+			{
+				parked = mask;
+			}
+			b->active &= ~(mask & ~g.mask & ~parked);
+			if (g.mask)
+			{
+				group_update(b, &g);
+			}
+		}
+
+		/* NOTE: the lanes waiting ahead join the group
+		 * when it reaches them */
+		if (!g.mask || g.pc >= g.next)
+		{
+			group_select(b, &g);
+		}
+	}
+}
+
+/* copy the program, or the state before the first input, into every
+ * lane and clear the rest */
+static void batch_reset(struct batch *b)
+{
+	batch_address(b, b->psize + 3);
+	for (size_t a = 0; a < b->psize; a++)
+	{
+		b->ram[a] = (vec){} + b->prog[a];
+	}
+	if (b->used > b->psize)
+	{
+		memset(b->ram + b->psize, 0, (b->used - b->psize) * sizeof(vec));
+	}
+	b->used = b->psize;
+	memset(b->code, 0, b->psize * sizeof(*b->code));
+}
+
+/* state of the program when it reads its first input */
+struct prefix
+{
+	int64_t *image;		/* memory up to the last cell not zero */
+	size_t size;
+	int64_t pc;
+	int64_t rbp;
+	int64_t *out;		/* outputs written before */
+	size_t nout;
+};
+
+/*
+ * The instructions before the first input are the same for every
+ * instance: they run once on a single lane and the lanes start from
+ * the state it reached. Returns 0 if the lane halted or filled its
+ * outputs first, then the lanes start from the program.
+ */
+static int batch_prefix(struct prefix *p, const int64_t *prog, size_t psize,
+			size_t noutputs)
+{
+	struct batch b = {
+		.prog = prog,
+		.psize = psize,
+		.code = malloc(psize * sizeof(*b.code)),
+	};
+	*p = (struct prefix){
+		.out = malloc((noutputs ? noutputs : 1) * sizeof(*p->out)),
+	};
+	if ((psize && !b.code) || !p->out)
+	{
+		free(b.code);
+		free(p->out);
+		return 0;
+	}
+
+	/* NOTE: the lane stops at the outputs like the others, a
+	 * program that never reads doesn't run forever here */
+	batch_reset(&b);
+	b.active = 1;
+	b.out[0] = p->out;
+	b.nout[0] = noutputs;
+	batch_run(&b);
+
+	size_t size = b.used;
+	while (size > psize && b.ram[size - 1][0] == 0)
+	{
+		size--;
+	}
+	int ok = b.waiting & 1;
+	if (ok)
+	{
+		p->image = malloc(size * sizeof(*p->image));
+		ok = p->image != NULL;
+	}
+	if (ok)
+	{
+		for (size_t a = 0; a < size; a++)
+		{
+			p->image[a] = b.ram[a][0];
+		}
+		p->size = size;
+		p->pc = b.pc[0];
+		p->rbp = b.rbp[0];
+		p->nout = noutputs - b.nout[0];
+	}
+	else
+	{
+		free(p->out);
+	}
+	free(b.code);
+	free(b.ram);
+	return ok;
+}
+
+void program_batch(const int64_t *prog, size_t psize, size_t count,
+		   const int64_t *inputs, size_t ninputs,
+		   int64_t *outputs, size_t noutputs)
+{
+	struct prefix p;
+	if (!batch_prefix(&p, prog, psize, noutputs))
+	{
+		p = (struct prefix){ .size = psize };
+	}
+
+	struct batch b = {
+		.prog = p.image ? p.image : prog,
+		.psize = p.size,
+		.code = malloc(p.size * sizeof(*b.code)),
+	};
+	if (p.size && !b.code)
+	{
+		fprintf(stderr, "Cannot allocate the decoded program\n");
+		abort();
+	}
+
+	memset(outputs, 0, count * noutputs * sizeof(*outputs));
+	for (size_t first = 0; first < count; first += LANES)
+	{
+		batch_reset(&b);
+		b.rbp = (vec){} + p.rbp;
+		b.active = 0;
+		for (int l = 0; l < LANES; l++)
+		{
+			size_t k = first + l < count ? first + l : first;
+			b.pc[l] = p.pc;
+			b.in[l] = inputs + k * ninputs;
+			b.nin[l] = ninputs;
+			b.out[l] = outputs + k * noutputs + p.nout;
+			b.nout[l] = noutputs - p.nout;
+			if (first + l < count)
+			{
+				if (p.nout)
+				{
+					memcpy(outputs + k * noutputs, p.out,
+					       p.nout * sizeof(*p.out));
+				}
+				b.active |= 1u<<l;
+			}
+		}
+		batch_run(&b);
+	}
+
+	free(p.image);
+	free(p.out);
+	free(b.code);
+	free(b.ram);
+}
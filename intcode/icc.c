@@ -0,0 +1,444 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intcode.h"
+#include "module.h"
+
+/*
+ * Ahead of time translator of an Intcode program to C, see native.h.
+ *
+ * Every instruction that can be reached from address 0 becomes a
+ * labelled block of the generated function: the fall through and the
+ * jumps to constant addresses are direct gotos, the other jumps go
+ * through a table of labels. The return addresses pushed by the
+ * calls (an immediate operand that points right after a jump) are
+ * reached as well. The instructions that overlap a cell written with
+ * an absolute operand are left to the interpreter.
+ */
+
+struct program
+{
+	const char *name;
+	int64_t *image;
+	size_t size;
+
+	struct insn *code;	/* decoded instruction at each address */
+	uint8_t *entry;		/* the instruction is compiled */
+	uint8_t *map;		/* cells covered by compiled instructions */
+	uint8_t *written;	/* targets of the absolute stores */
+	int64_t *work;		/* addresses to visit */
+};
+
+static int insn_len(const struct insn *i)
+{
+	return i->op == OP_HALT ? 1 : 1 + op_args[i->op];
+}
+
+/* the instruction at pc can be compiled */
+static int compilable(const struct program *p, int64_t pc)
+{
+	if (pc < 0 || (uint64_t)pc >= p->size || p->code[pc].op == INSN_FAULT)
+	{
+		return 0;
+	}
+	int len = insn_len(p->code + pc);
+	if ((uint64_t)(pc + len) > p->size)
+	{
+		return 0;
+	}
+	for (int k = 0; k < len; k++)
+	{
+		if (p->written[pc + k])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* immediate operand that might be a return address */
+static int return_address(const struct program *p, int64_t v)
+{
+	if (v < 3 || (uint64_t)v >= p->size)
+	{
+		return 0;
+	}
+	int op = p->code[v - 3].op;
+	return op == OP_JNZ || op == OP_JZ;
+}
+
+/* find the compiled instructions, returns the cells newly written */
+static size_t program_reach(struct program *p)
+{
+	size_t nwork = 0;
+	size_t added = 0;
+	memset(p->entry, 0, p->size);
+	memset(p->map, 0, p->size);
+	p->work[nwork++] = 0;
+	while (nwork)
+	{
+		int64_t pc = p->work[--nwork];
+		if (p->entry[pc] || !compilable(p, pc))
+		{
+			continue;
+		}
+
+		const struct insn *i = p->code + pc;
+		int len = insn_len(i);
+		p->entry[pc] = 1;
+		memset(p->map + pc, 1, len);
+
+		/* NOTE: each address is pushed at most once per
+		 * operand of a compiled instruction, the work list
+		 * has room for all of them */
+		for (int k = 0; k < op_args[i->op]; k++)
+		{
+			int64_t arg = i->arg[k];
+			if (i->kind[k] == ARG_IMM &&
+			    ((k == 1 && (i->op == OP_JNZ || i->op == OP_JZ)) ||
+			     return_address(p, arg)) &&
+			    0 <= arg && (uint64_t)arg < p->size)
+			{
+				p->work[nwork++] = arg;
+			}
+			else if ((op_dest[i->op] & 1<<k) && i->kind[k] == ARG_ABS &&
+				 (uint64_t)arg < p->size && !p->written[arg])
+			{
+				p->written[arg] = 1;
+				added++;
+			}
+		}
+		if (i->op != OP_HALT && (uint64_t)(pc + len) < p->size)
+		{
+			p->work[nwork++] = pc + len;
+		}
+	}
+	return added;
+}
+
+static void emit_int(FILE *out, int64_t v)
+{
+	if (v == INT64_MIN)
+	{
+		fprintf(out, "INT64_MIN");
+	}
+	else
+	{
+		fprintf(out, "INT64_C(%" PRId64 ")", v);
+	}
+}
+
+static void emit_load(const struct program *p, FILE *out, const struct insn *i, int k)
+{
+	int64_t arg = i->arg[k];
+	switch (i->kind[k])
+	{
+	case ARG_IMM:
+		emit_int(out, arg);
+		break;
+
+	case ARG_ABS:
+		fprintf(out, "m->ram[%" PRId64 "]", arg);
+		break;
+
+	case ARG_REL:
+		fprintf(out, "native_get(m, rbp + ");
+		emit_int(out, arg);
+		fprintf(out, ")");
+		break;
+
+	default:
+		fprintf(out, "native_get(m, ");
+		emit_int(out, arg);
+		fprintf(out, ")");
+		break;
+	}
+}
+
+/* leave the translated code to continue at pc */
+static void emit_exit(FILE *out, const char *indent, int64_t pc)
+{
+	fprintf(out, "%sm->pc = %" PRId64 ";\n", indent, pc);
+	fprintf(out, "%sgoto leave;\n", indent);
+}
+
+/* store value into the operand k, then the instruction is retired */
+static void emit_store(const struct program *p, FILE *out, const struct insn *i,
+		       int k, const char *value, int64_t next)
+{
+	int64_t arg = i->arg[k];
+	if (i->kind[k] == ARG_ABS && (uint64_t)arg < p->size)
+	{
+		/* NOTE: the cell is never covered by compiled code,
+		 * see program_reach() */
+		fprintf(out, "\tm->ram[%" PRId64 "] = %s;\n", arg, value);
+		fprintf(out, "\tm->dirty[%" PRId64 "] = 1;\n", arg >> PAGE_SHIFT);
+		fprintf(out, "\tmodule_invalidate(m, %" PRId64 ");\n", arg);
+	}
+	else
+	{
+		fprintf(out, "\tif (!native_put(m, %s", i->kind[k] == ARG_REL ? "rbp + " : "");
+		emit_int(out, arg);
+		fprintf(out, ", %s))\n\t{\n\t\tsteps++;\n", value);
+		emit_exit(out, "\t\t", next);
+		fprintf(out, "\t}\n");
+	}
+	fprintf(out, "\tsteps++;\n");
+}
+
+static void emit_jump(const struct program *p, FILE *out, const struct insn *i,
+		      const char *cond)
+{
+	fprintf(out, "\tif (");
+	emit_load(p, out, i, 0);
+	fprintf(out, " %s 0)\n\t{\n\t\tsteps++;\n", cond);
+	if (i->kind[1] == ARG_IMM && compilable(p, i->arg[1]) && p->entry[i->arg[1]])
+	{
+		fprintf(out, "\t\tgoto L%" PRId64 ";\n", i->arg[1]);
+	}
+	else if (i->kind[1] == ARG_IMM)
+	{
+		emit_exit(out, "\t\t", i->arg[1]);
+	}
+	else
+	{
+		fprintf(out, "\t\tm->pc = ");
+		emit_load(p, out, i, 1);
+		fprintf(out, ";\n");
+		fprintf(out, "\t\tif ((uint64_t)m->pc < %zu)\n", p->size);
+		fprintf(out, "\t\t{\n\t\t\tgoto *label[m->pc];\n\t\t}\n");
+		fprintf(out, "\t\tgoto leave;\n");
+	}
+	fprintf(out, "\t}\n\tsteps++;\n");
+}
+
+static void emit_insn(const struct program *p, FILE *out, int64_t pc)
+{
+	const struct insn *i = p->code + pc;
+	int len = insn_len(i);
+	int64_t next = pc + len;
+
+	fprintf(out, "L%" PRId64 ":\t/*", pc);
+	for (int k = 0; k < len; k++)
+	{
+		fprintf(out, " %" PRId64, p->image[pc + k]);
+	}
+	fprintf(out, " */\n");
+
+	static const char *const binop[] = {
+		[OP_ADD] = "+",
+		[OP_MUL] = "*",
+		[OP_TLT] = "<",
+		[OP_TEQ] = "==",
+	};
+	switch (i->op)
+	{
+	case OP_ADD:
+	case OP_MUL:
+	case OP_TLT:
+	case OP_TEQ:
+		fprintf(out, "\ta = ");
+		emit_load(p, out, i, 0);
+		fprintf(out, ";\n\tb = ");
+		emit_load(p, out, i, 1);
+		fprintf(out, ";\n");
+		fprintf(out, "\ta = a %s b;\n", binop[i->op]);
+		emit_store(p, out, i, 2, "a", next);
+		break;
+
+	case OP_IN:
+		fprintf(out, "\tstatus = native_input(m, &a);\n");
+		fprintf(out, "\tif (status >= 0)\n\t{\n");
+		fprintf(out, "\t\tm->pc = %" PRId64 ";\n\t\tgoto out;\n\t}\n", pc);
+		emit_store(p, out, i, 0, "a", next);
+		break;
+
+	case OP_OUT:
+		fprintf(out, "\tnative_output(m, ");
+		emit_load(p, out, i, 0);
+		fprintf(out, ");\n\tsteps++;\n");
+		break;
+
+	case OP_JNZ:
+		emit_jump(p, out, i, "!=");
+		break;
+
+	case OP_JZ:
+		emit_jump(p, out, i, "==");
+		break;
+
+	case OP_ARB:
+		fprintf(out, "\trbp += ");
+		emit_load(p, out, i, 0);
+		fprintf(out, ";\n\tsteps++;\n");
+		break;
+
+	case OP_HALT:
+		fprintf(out, "\tm->pc = %" PRId64 ";\n", pc);
+		fprintf(out, "\tstatus = HALTED;\n\tgoto out;\n");
+		return;
+	}
+
+	/* fall through to the next instruction */
+	int64_t follow = pc + 1;
+	while ((uint64_t)follow < p->size && !p->entry[follow])
+	{
+		follow++;
+	}
+	if ((uint64_t)next < p->size && p->entry[next])
+	{
+		if (follow != next)
+		{
+			fprintf(out, "\tgoto L%" PRId64 ";\n", next);
+		}
+	}
+	else
+	{
+		emit_exit(out, "\t", next);
+	}
+}
+
+static void emit_bytes(FILE *out, const char *name, const uint8_t *v, size_t n)
+{
+	fprintf(out, "static const uint8_t %s[%zu] = {", name, n);
+	for (size_t k = 0; k < n; k++)
+	{
+		fprintf(out, "%s%u,", k % 32 ? "" : "\n\t", v[k]);
+	}
+	fprintf(out, "\n};\n\n");
+}
+
+static void program_emit(const struct program *p, FILE *out)
+{
+	fprintf(out, "/* translated by icc from %s, do not edit */\n\n", p->name);
+	fprintf(out, "#include <stdint.h>\n\n#include \"native.h\"\n\n");
+
+	fprintf(out, "static const int64_t image[%zu] = {", p->size);
+	for (size_t k = 0; k < p->size; k++)
+	{
+		fprintf(out, "%s", k % 8 ? " " : "\n\t");
+		emit_int(out, p->image[k]);
+		fprintf(out, ",");
+	}
+	fprintf(out, "\n};\n\n");
+	emit_bytes(out, "entry", p->entry, p->size);
+	emit_bytes(out, "map", p->map, p->size);
+
+	fprintf(out, "static int run(struct module *m)\n{\n");
+	fprintf(out, "\tstatic const void *const label[%zu] = {\n", p->size);
+	fprintf(out, "\t\t[0 ... %zu] = &&leave,\n", p->size - 1);
+	for (size_t pc = 0; pc < p->size; pc++)
+	{
+		if (p->entry[pc])
+		{
+			fprintf(out, "\t\t[%zu] = &&L%zu,\n", pc, pc);
+		}
+	}
+	fprintf(out, "\t};\n");
+	fprintf(out, "\tint64_t rbp = m->rbp;\n");
+	fprintf(out, "\tint64_t a, b;\n");
+	fprintf(out, "\tuint64_t steps = 0;\n");
+	fprintf(out, "\tint status;\n\n");
+	fprintf(out, "\tgoto *label[m->pc];\n\n");
+
+	for (size_t pc = 0; pc < p->size; pc++)
+	{
+		if (p->entry[pc])
+		{
+			emit_insn(p, out, pc);
+		}
+	}
+
+	/* NOTE: out is referenced here too, a program without
+	 * inputs and halts has no other jump to it */
+	fprintf(out, "\nleave:\n\tstatus = NATIVE_EXIT;\n\tgoto out;\n");
+	fprintf(out, "out:\n\tm->rbp = rbp;\n\tm->steps += steps;\n");
+	fprintf(out, "\t(void)a;\n\t(void)b;\n\treturn status;\n}\n\n");
+
+	fprintf(out, "static struct native native = {\n");
+	fprintf(out, "\t.name = \"%s\",\n", p->name);
+	fprintf(out, "\t.image = image,\n");
+	fprintf(out, "\t.isize = %zu,\n", p->size);
+	fprintf(out, "\t.entry = entry,\n");
+	fprintf(out, "\t.map = map,\n");
+	fprintf(out, "\t.run = run,\n");
+	fprintf(out, "};\n\n");
+	fprintf(out, "__attribute__((constructor))\n");
+	fprintf(out, "static void native_init(void)\n{\n");
+	fprintf(out, "\tnative_register(&native);\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <input> [<output.c>]\n", argv[0]);
+		return -1;
+	}
+
+	FILE *input = fopen(argv[1], "rb");
+	if (!input)
+	{
+		fprintf(stderr, "File %s not found\n", argv[1]);
+		return -1;
+	}
+
+	struct program p = { .name = argv[1] };
+	p.image = program_load(input, &p.size);
+	fclose(input);
+	if (!p.image || !p.size)
+	{
+		fprintf(stderr, "Cannot load the intcode program\n");
+		free(p.image);
+		return -1;
+	}
+
+	/* NOTE: the operands of the last cells read past the end of
+	 * the program */
+	int64_t *cell = calloc(p.size + 3, sizeof(*cell));
+	p.code = calloc(p.size, sizeof(*p.code));
+	p.entry = calloc(p.size, 1);
+	p.map = calloc(p.size, 1);
+	p.written = calloc(p.size, 1);
+	p.work = calloc(4 * p.size + 1, sizeof(*p.work));
+	if (!cell || !p.code || !p.entry || !p.map || !p.written || !p.work)
+	{
+		fprintf(stderr, "Cannot allocate the translator\n");
+		return -1;
+	}
+	memcpy(cell, p.image, p.size * sizeof(*cell));
+	for (size_t pc = 0; pc < p.size; pc++)
+	{
+		insn_decode(p.code + pc, cell + pc, p.size);
+	}
+	free(cell);
+
+	/* the stores of the compiled code can exclude more code,
+	 * repeat until nothing changes */
+	while (program_reach(&p))
+	{
+	}
+
+	FILE *out = stdout;
+	if (argc > 2 && !(out = fopen(argv[2], "w")))
+	{
+		fprintf(stderr, "Cannot create %s\n", argv[2]);
+		return -1;
+	}
+	program_emit(&p, out);
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+
+	free(p.work);
+	free(p.written);
+	free(p.map);
+	free(p.entry);
+	free(p.code);
+	free(p.image);
+	return 0;
+}
@@ -0,0 +1,227 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "intcode.h"
+#include "module.h"
+
+/*
+ * The image keeps the state of a module right after it loaded the
+ * program, with every instruction already decoded. On Linux it is
+ * written once into an anonymous file; the modules map the memory and
+ * the code from there with MAP_PRIVATE, so the pages they only read
+ * stay shared in the page cache and the kernel copies a page for a
+ * module the first time it writes it. The interpreter sees the same
+ * flat arrays as usual. Elsewhere each module gets its own copy of the
+ * image, which still saves the decoding.
+ */
+
+#ifdef __linux__
+static size_t page_round(size_t bytes)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t p = page > 0 ? page : 4096;
+	return (bytes + p - 1) / p * p;
+}
+
+static int write_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+	while (len)
+	{
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n <= 0)
+		{
+			return 0;
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 1;
+}
+
+/* move the copies into a file that can be mapped, -1 on error */
+static int image_share(struct image *img)
+{
+	int fd = memfd_create("intcode", MFD_CLOEXEC);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	size_t rbytes = img->size * sizeof(*img->ram);
+	size_t cbytes = img->ncode * sizeof(*img->code);
+	img->code_offset = page_round(rbytes);
+	if (ftruncate(fd, img->code_offset + cbytes) < 0 ||
+	    !write_all(fd, img->ram, rbytes, 0) ||
+	    !write_all(fd, img->code, cbytes, img->code_offset))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+#else
+static int image_share(struct image *img)
+{
+	(void)img;
+	return -1;
+}
+#endif
+
+struct image *image_new(const int64_t *prog, size_t psize)
+{
+	struct image *img = calloc(1, sizeof(*img));
+	struct module *m = module_new();
+	if (!img || !m)
+	{
+		free(img);
+		free(m);
+		return NULL;
+	}
+
+	/* decode now what the first fetch of each address would */
+	module_load(m, prog, psize);
+	for (size_t pc = 0; pc < m->ncode; pc++)
+	{
+		if (m->code[pc].op == INSN_STALE)
+		{
+			module_decode(m, pc, m->code + pc);
+			module_fuse(m, pc, m->code + pc);
+		}
+	}
+
+	img->refs = 1;
+	img->psize = psize;
+	img->size = m->size;
+	img->ncode = m->ncode;
+	img->near_lo = m->near_lo;
+	img->near_hi = m->near_hi;
+	img->near = m->near;
+	img->prog = malloc(psize * sizeof(*prog));
+	img->ram = malloc(m->size * sizeof(*m->ram));
+	img->code = malloc(m->ncode * sizeof(*m->code));
+	if (!img->prog || !img->ram || (m->ncode && !img->code))
+	{
+		img->fd = -1;
+		image_free(img);
+		module_free(m);
+		return NULL;
+	}
+	memcpy(img->prog, prog, psize * sizeof(*prog));
+	memcpy(img->ram, m->ram, m->size * sizeof(*m->ram));
+	memcpy(img->code, m->code, m->ncode * sizeof(*m->code));
+	module_free(m);
+
+	/* NOTE: an empty program has nothing to share */
+	img->fd = img->ncode ? image_share(img) : -1;
+	if (img->fd >= 0)
+	{
+		free(img->ram);
+		free(img->code);
+		img->ram = NULL;
+		img->code = NULL;
+	}
+	return img;
+}
+
+void image_free(struct image *img)
+{
+	if (img && --img->refs == 0)
+	{
+		if (img->fd >= 0)
+		{
+			close(img->fd);
+		}
+		free(img->code);
+		free(img->ram);
+		free(img->prog);
+		free(img);
+	}
+}
+
+void image_map(struct module *m, struct image *img)
+{
+	m->size = img->size;
+	m->ncode = m->csize = img->ncode;
+	if (img->fd < 0)
+	{
+		m->ram = malloc(img->size * sizeof(*m->ram));
+		m->code = malloc(img->ncode * sizeof(*m->code));
+		if (!m->ram || (img->ncode && !m->code))
+		{
+			fprintf(stderr, "Cannot allocate the memory of the image\n");
+			abort();
+		}
+		memcpy(m->ram, img->ram, img->size * sizeof(*m->ram));
+		memcpy(m->code, img->code, img->ncode * sizeof(*m->code));
+		m->image = img;
+		m->image_ram = 0;
+		img->refs++;
+		return;
+	}
+
+	void *ram = mmap(NULL, img->size * sizeof(*m->ram), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE, img->fd, 0);
+	void *code = mmap(NULL, img->ncode * sizeof(*m->code), PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE, img->fd, img->code_offset);
+	if (ram == MAP_FAILED || code == MAP_FAILED)
+	{
+		fprintf(stderr, "Cannot map the image\n");
+		abort();
+	}
+	m->ram = ram;
+	m->code = code;
+	m->image = img;
+	m->image_ram = 1;
+	img->refs++;
+}
+
+void image_copy_ram(struct module *m)
+{
+	int64_t *ram = malloc(m->size * sizeof(*ram));
+	if (!ram)
+	{
+		fprintf(stderr, "Cannot copy the memory of the image\n");
+		abort();
+	}
+	memcpy(ram, m->ram, m->size * sizeof(*ram));
+	munmap(m->ram, m->size * sizeof(*m->ram));
+	m->ram = ram;
+	m->image_ram = 0;
+}
+
+void image_unmap(struct module *m)
+{
+	if (m->image_ram)
+	{
+		munmap(m->ram, m->size * sizeof(*m->ram));
+	}
+	else
+	{
+		free(m->ram);
+	}
+	if (m->image->fd >= 0)
+	{
+		munmap(m->code, m->ncode * sizeof(*m->code));
+	}
+	else
+	{
+		free(m->code);
+	}
+
+	m->ram = NULL;
+	m->code = NULL;
+	m->size = 0;
+	m->ncode = m->csize = 0;
+	m->image_ram = 0;
+	image_free(m->image);
+	m->image = NULL;
+}
@@ -0,0 +1,1743 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intcode.h"
+#include "module.h"
+#include "jit.h"
+#include "native.h"
+#include "profile.h"
+#include "memo.h"
+
+static void sparse_clear(struct sparse *s);
+
+/* programs translated by icc, see native.h */
+static struct native *natives;
+
+void native_register(struct native *n)
+{
+	n->next = natives;
+	natives = n;
+}
+
+struct module *module_new(void)
+{
+	return calloc(1, sizeof(struct module));
+}
+
+void module_free(struct module *m)
+{
+	if (m)
+	{
+#ifdef INTCODE_PROFILE
+		profile_free(m);
+#endif
+#ifdef INTCODE_JIT
+		jit_free(m->jit);
+#endif
+		memo_free(m->memo);
+		snapshot_free(m->base);
+		if (m->image)
+		{
+			image_unmap(m);
+		}
+		free(m->in.buf);
+		free(m->out.buf);
+		free(m->code);
+		sparse_clear(&m->far);
+		free(m->written);
+		free(m->dirty);
+		free(m->ram);
+		free(m);
+	}
+}
+
+static void module_grow(struct module *m, int64_t pos)
+{
+	if (m->image_ram)
+	{
+		image_copy_ram(m);
+	}
+
+	size_t nsize = m->size ? m->size : 1024;
+	while ((size_t)pos >= nsize)
+	{
+		nsize *= 2;
+	}
+
+	/* NOTE: only a program larger than the dense memory can
+	 * make it grow past DENSE_CELLS */
+	if (nsize > DENSE_CELLS && (size_t)pos < DENSE_CELLS)
+	{
+		nsize = DENSE_CELLS;
+	}
+
+	int64_t *nram = realloc(m->ram, nsize * sizeof(*nram));
+	uint8_t *ndirty = realloc(m->dirty, nsize >> PAGE_SHIFT);
+	uint8_t *nwritten = realloc(m->written, nsize >> PAGE_SHIFT);
+	if (nram) m->ram = nram;
+	if (ndirty) m->dirty = ndirty;
+	if (nwritten) m->written = nwritten;
+	if (!nram || !ndirty || !nwritten)
+	{
+		fprintf(stderr, "Cannot grow the memory to %zu cells\n", nsize);
+		abort();
+	}
+
+	/* NOTE: realloc() doesn't guarantee that the added
+	 * memory is zeroed. */
+	memset(nram + m->size, 0, (nsize - m->size) * sizeof(*nram));
+	memset(ndirty + (m->size >> PAGE_SHIFT), 1, (nsize - m->size) >> PAGE_SHIFT);
+	memset(nwritten + (m->size >> PAGE_SHIFT), 0, (nsize - m->size) >> PAGE_SHIFT);
+	m->size = nsize;
+}
+
+static void invalid_address(struct module *m, int64_t pos)
+{
+	fprintf(stderr, "Invalid address %" PRId64 " at %" PRId64 "\n",
+		pos, m->pc);
+	abort();
+}
+
+/* slot of the table with the given key, or the empty slot for it */
+static struct table **sparse_slot(const struct sparse *s, uint64_t key)
+{
+	size_t mask = s->cap - 1;
+	size_t h = (size_t)((key * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & mask;
+	while (s->slot[h] && s->slot[h]->key != key)
+	{
+		h = (h + 1) & mask;
+	}
+	return s->slot + h;
+}
+
+static void sparse_rehash(struct sparse *s)
+{
+	struct sparse n = {
+		.cap = s->cap ? s->cap * 2 : 16,
+		.count = s->count,
+	};
+	n.slot = calloc(n.cap, sizeof(*n.slot));
+	if (!n.slot)
+	{
+		fprintf(stderr, "Cannot grow the page tables to %zu\n", n.cap);
+		abort();
+	}
+	for (size_t h = 0; h < s->cap; h++)
+	{
+		if (s->slot[h])
+		{
+			*sparse_slot(&n, s->slot[h]->key) = s->slot[h];
+		}
+	}
+	free(s->slot);
+	*s = n;
+}
+
+/* page slot of the address, NULL if its table is missing */
+static struct page **sparse_page(struct sparse *s, uint64_t addr, int create)
+{
+	uint64_t key = addr >> (PAGE_SHIFT + TABLE_SHIFT);
+	struct table *t = s->last;
+	if (!t || t->key != key)
+	{
+		t = s->cap ? *sparse_slot(s, key) : NULL;
+		if (!t)
+		{
+			if (!create)
+			{
+				return NULL;
+			}
+			if ((s->count + 1) * 2 > s->cap)
+			{
+				sparse_rehash(s);
+			}
+			t = calloc(1, sizeof(*t));
+			if (!t)
+			{
+				fprintf(stderr, "Cannot allocate a page table\n");
+				abort();
+			}
+			t->key = key;
+			*sparse_slot(s, key) = t;
+			s->count++;
+		}
+		s->last = t;
+	}
+	return t->page + ((addr >> PAGE_SHIFT) & (TABLE_PAGES - 1));
+}
+
+static int64_t sparse_load(struct sparse *s, uint64_t addr)
+{
+	struct page **pp = sparse_page(s, addr, 0);
+	return pp && *pp ? (*pp)->cell[addr & (PAGE_CELLS - 1)] : 0;
+}
+
+static void sparse_store(struct sparse *s, uint64_t addr, int64_t value)
+{
+	struct page **pp = sparse_page(s, addr, 1);
+	struct page *p = *pp;
+	if (!p || p->refs > 1)
+	{
+		/* the pages are zero filled on the first write and
+		 * copied when they are shared with a snapshot */
+		struct page *np = p ? malloc(sizeof(*np)) : calloc(1, sizeof(*np));
+		if (!np)
+		{
+			fprintf(stderr, "Cannot allocate a page\n");
+			abort();
+		}
+		if (p)
+		{
+			memcpy(np->cell, p->cell, sizeof(np->cell));
+			p->refs--;
+		}
+		np->refs = 1;
+		*pp = p = np;
+	}
+	p->cell[addr & (PAGE_CELLS - 1)] = value;
+}
+
+static void sparse_clear(struct sparse *s)
+{
+	for (size_t h = 0; h < s->cap; h++)
+	{
+		struct table *t = s->slot[h];
+		if (!t)
+		{
+			continue;
+		}
+		for (size_t k = 0; k < TABLE_PAGES; k++)
+		{
+			if (t->page[k] && --t->page[k]->refs == 0)
+			{
+				free(t->page[k]);
+			}
+		}
+		free(t);
+	}
+	free(s->slot);
+	memset(s, 0, sizeof(*s));
+}
+
+/* the cells outside of the dense memory */
+static int64_t load_far(struct module *m, int64_t pos)
+{
+	if (pos < 0)
+	{
+		invalid_address(m, pos);
+	}
+	else if (pos < DENSE_CELLS)
+	{
+		module_grow(m, pos);
+		return m->ram[pos];
+	}
+	return sparse_load(&m->far, pos);
+}
+
+static inline int64_t load(struct module *m, int64_t pos)
+{
+	if ((uint64_t)pos < m->size)
+	{
+		return m->ram[pos];
+	}
+	return load_far(m, pos);
+}
+
+/* copy the first n values of the queue, the ring wraps at most once */
+static void queue_read(const struct queue *q, int64_t *values, size_t n)
+{
+	if (n == 0)
+	{
+		return;
+	}
+	size_t first = q->r & (q->cap - 1);
+	size_t head = q->cap - first < n ? q->cap - first : n;
+	memcpy(values, q->buf + first, head * sizeof(*values));
+	memcpy(values + head, q->buf, (n - head) * sizeof(*values));
+}
+
+/* make room for n more values */
+static void queue_grow(struct queue *q, size_t n)
+{
+	size_t len = q->w - q->r;
+	size_t ncap = q->cap ? q->cap : 32;
+	while (ncap - len < n)
+	{
+		ncap *= 2;
+	}
+
+	int64_t *nbuf = malloc(ncap * sizeof(*nbuf));
+	if (!nbuf)
+	{
+		fprintf(stderr, "Cannot grow the queue to %zu values\n", ncap);
+		abort();
+	}
+	queue_read(q, nbuf, len);
+	free(q->buf);
+	q->buf = nbuf;
+	q->cap = ncap;
+	q->r = 0;
+	q->w = len;
+}
+
+static void queue_write(struct queue *q, const int64_t *values, size_t n)
+{
+	if (q->cap - (q->w - q->r) < n)
+	{
+		queue_grow(q, n);
+	}
+	if (n == 0)
+	{
+		return;
+	}
+	size_t first = q->w & (q->cap - 1);
+	size_t head = q->cap - first < n ? q->cap - first : n;
+	memcpy(q->buf + first, values, head * sizeof(*values));
+	memcpy(q->buf, values + head, (n - head) * sizeof(*values));
+	q->w += n;
+}
+
+/* replace the values of dst with the ones of src */
+static void queue_assign(struct queue *dst, const struct queue *src)
+{
+	dst->r = dst->w = 0;
+	size_t len = src->w - src->r;
+	if (dst->cap < len)
+	{
+		queue_grow(dst, len);
+	}
+	queue_read(src, dst->buf, len);
+	dst->w = len;
+}
+
+static inline void queue_push(struct queue *q, int64_t value)
+{
+	if (q->w - q->r == q->cap)
+	{
+		queue_grow(q, 1);
+	}
+	q->buf[(q->w++) & (q->cap - 1)] = value;
+}
+
+static inline int64_t queue_pop(struct queue *q)
+{
+	return q->buf[(q->r++) & (q->cap - 1)];
+}
+
+void insn_decode(struct insn *i, const int64_t *cell, size_t size)
+{
+	int64_t v = cell[0];
+	int op = v % 100;
+	memset(i, 0, sizeof(*i));
+	if (v < 0 || (op != OP_HALT && op_args[op] == 0))
+	{
+		i->op = INSN_FAULT;
+		return;
+	}
+
+	i->op = op;
+	v /= 100;
+	for (int k = 0; k < op_args[op]; k++, v /= 10)
+	{
+		int64_t arg = cell[1 + k];
+		switch (v % 10)
+		{
+		case PMODE:
+			i->kind[k] = (uint64_t)arg < size ? ARG_ABS : ARG_FAR;
+			break;
+
+		case IMODE:
+			if (op_dest[op] & 1<<k)
+			{
+				i->op = INSN_FAULT;
+			}
+			i->kind[k] = ARG_IMM;
+			break;
+
+		case RMODE:
+			i->kind[k] = ARG_REL;
+			break;
+
+		default:
+			i->op = INSN_FAULT;
+			break;
+		}
+		i->arg[k] = arg;
+	}
+}
+
+void module_decode(struct module *m, int64_t pc, struct insn *i)
+{
+	insn_decode(i, m->ram + pc, m->size);
+	if (m->near && i->op != INSN_FAULT)
+	{
+		for (int k = 0; k < op_args[i->op]; k++)
+		{
+			if (i->kind[k] == ARG_REL &&
+			    m->near_lo <= i->arg[k] && i->arg[k] <= m->near_hi)
+			{
+				i->kind[k] = ARG_NEAR;
+			}
+		}
+	}
+}
+
+/* the operand k of a and the operand l of b are the same cell */
+static int same_cell(const struct insn *a, int k, const struct insn *b, int l)
+{
+	return a->kind[k] != ARG_IMM && a->kind[k] == b->kind[l] &&
+		a->arg[k] == b->arg[l];
+}
+
+void module_fuse(struct module *m, int64_t pc, struct insn *i)
+{
+	if (i->op != OP_TLT && i->op != OP_TEQ && i->op != OP_ARB)
+	{
+		return;
+	}
+	int len = op_args[i->op] + 1;
+	if ((uint64_t)pc + len + 3 > m->ncode)
+	{
+		return;
+	}
+
+	struct insn *next = i + len;
+	if (next->op == INSN_STALE)
+	{
+		module_decode(m, pc + len, next);
+	}
+	int op = insn_unfused(next->op);
+	if (op != OP_JNZ && op != OP_JZ)
+	{
+		return;
+	}
+
+	if (i->op == OP_ARB)
+	{
+		/* only the unconditional jumps */
+		if (next->kind[0] == ARG_IMM && (next->arg[0] != 0) == (op == OP_JNZ))
+		{
+			i->op = INSN_ARB_JMP;
+		}
+	}
+	else if (same_cell(i, 2, next, 0))
+	{
+		i->op = i->op == OP_TLT
+			? (op == OP_JNZ ? INSN_TLT_JNZ : INSN_TLT_JZ)
+			: (op == OP_JNZ ? INSN_TEQ_JNZ : INSN_TEQ_JZ);
+	}
+}
+
+/* the operand kinds changed, decode the program again */
+static void module_recode(struct module *m)
+{
+	for (size_t pc = 0; pc < m->ncode; pc++)
+	{
+		m->code[pc].op = INSN_STALE;
+	}
+}
+
+void module_rebase(struct module *m)
+{
+	int64_t lo = m->rbp + m->near_lo;
+	int64_t hi = m->rbp + m->near_hi;
+	if (lo >= 0 && (hi < DENSE_CELLS || hi < (int64_t)m->size))
+	{
+		if (hi >= (int64_t)m->size)
+		{
+			module_grow(m, hi);
+		}
+		if (!m->near)
+		{
+			m->near = 1;
+			module_recode(m);
+		}
+	}
+	else if (m->near)
+	{
+		m->near = 0;
+		m->near_misses++;
+		module_recode(m);
+	}
+}
+
+/*
+ * Find the footprint of the loaded program. The absolute operands
+ * that point a little past the program are made part of the memory
+ * so that they need no checks, and the relative operands give the
+ * window that must stay inside the memory around rbp.
+ */
+static void module_verify(struct module *m)
+{
+	int64_t limit = 2 * m->ncode + PAGE_CELLS;
+	int64_t top = -1;
+	int64_t lo = INT64_MAX;
+	int64_t hi = INT64_MIN;
+	for (size_t pc = 0; pc < m->ncode; pc++)
+	{
+		const struct insn *i = m->code + pc;
+		if (i->op == INSN_FAULT)
+		{
+			continue;
+		}
+		for (int k = 0; k < op_args[i->op]; k++)
+		{
+			int64_t arg = i->arg[k];
+			if (i->kind[k] == ARG_FAR && 0 <= arg && arg < limit)
+			{
+				top = arg > top ? arg : top;
+			}
+			else if (i->kind[k] == ARG_REL && -NEAR_SPAN <= arg && arg <= NEAR_SPAN)
+			{
+				lo = arg < lo ? arg : lo;
+				hi = arg > hi ? arg : hi;
+			}
+		}
+	}
+
+	if (top >= (int64_t)m->size)
+	{
+		module_grow(m, top);
+		for (size_t pc = 0; pc < m->ncode; pc++)
+		{
+			module_decode(m, pc, m->code + pc);
+		}
+	}
+
+	m->near_lo = lo <= hi ? lo : 0;
+	m->near_hi = lo <= hi ? hi : 0;
+	m->near = 0;
+	m->near_misses = 0;
+	module_rebase(m);
+}
+
+void module_invalidate(struct module *m, int64_t addr)
+{
+	/* NOTE: a superinstruction covers the cells of the
+	 * instruction after it */
+	int64_t first = addr >= FUSE_SPAN - 1 ? addr - (FUSE_SPAN - 1) : 0;
+	for (int64_t pc = first; pc <= addr; pc++)
+	{
+		m->code[pc].op = INSN_STALE;
+	}
+#ifdef INTCODE_JIT
+	if (m->jit && m->jit->map[addr])
+	{
+		m->jit->flush = 1;
+	}
+#endif
+	if (m->native && m->native->map[addr])
+	{
+		/* the rest of the execution is interpreted */
+		m->native = NULL;
+	}
+	if (m->memo && (uint64_t)addr < m->memo->isize && m->memo->map[addr])
+	{
+		m->memo->flush = 1;
+	}
+}
+
+static void module_fault(struct module *m)
+{
+	int64_t v = load(m, m->pc);
+	if (v >= 0 && (v % 100 == OP_HALT || op_args[v % 100]))
+	{
+		fprintf(stderr, "Invalid addressing mode %" PRId64 " at %" PRId64 "\n",
+			v, m->pc);
+	}
+	else
+	{
+		fprintf(stderr, "Unknown opcode %" PRId64 " at %" PRId64 "\n",
+			v, m->pc);
+	}
+	abort();
+}
+
+void module_load(struct module *m, const int64_t *prog, size_t psize)
+{
+	if (m->image)
+	{
+		image_unmap(m);
+	}
+
+	/* NOTE: leave room for the operands of the last cell */
+	if (psize + 3 >= m->size)
+	{
+		module_grow(m, psize + 3);
+	}
+
+	/* reset the memory: only the pages written since the last
+	 * load might not be zero, then copy the program */
+	size_t npages = m->size >> PAGE_SHIFT;
+	for (size_t i = psize >> PAGE_SHIFT; i < npages; i++)
+	{
+		if (m->written[i] | m->dirty[i])
+		{
+			size_t lo = i << PAGE_SHIFT;
+			if (lo < psize)
+			{
+				lo = psize;
+			}
+			memset(m->ram + lo, 0, (((i + 1) << PAGE_SHIFT) - lo) * sizeof(m->ram[0]));
+		}
+	}
+	memcpy(m->ram, prog, psize * sizeof(m->ram[0]));
+	memset(m->written, 0, npages);
+	memset(m->written, 1, (psize + PAGE_CELLS - 1) >> PAGE_SHIFT);
+	memset(m->dirty, 0, npages);
+	sparse_clear(&m->far);
+
+	/* decode the program once, the writes into the code will
+	 * mark the affected instructions as stale */
+	if (m->csize < psize)
+	{
+		struct insn *ncode = realloc(m->code, psize * sizeof(*ncode));
+		if (!ncode)
+		{
+			fprintf(stderr, "Cannot allocate the decoded program\n");
+			abort();
+		}
+		m->code = ncode;
+		m->csize = psize;
+	}
+	m->ncode = psize;
+	m->near = 0;
+	for (size_t pc = 0; pc < psize; pc++)
+	{
+		module_decode(m, pc, m->code + pc);
+	}
+
+	module_start(m, prog, psize);
+	module_verify(m);
+}
+
+void module_load_image(struct module *m, struct image *img)
+{
+	/* NOTE: m may hold the last reference to img */
+	img->refs++;
+	if (m->image)
+	{
+		image_unmap(m);
+	}
+	else
+	{
+		free(m->ram);
+		free(m->code);
+	}
+	image_map(m, img);
+	image_free(img);
+
+	size_t npages = m->size >> PAGE_SHIFT;
+	uint8_t *ndirty = realloc(m->dirty, npages);
+	uint8_t *nwritten = realloc(m->written, npages);
+	if (ndirty) m->dirty = ndirty;
+	if (nwritten) m->written = nwritten;
+	if (!ndirty || !nwritten)
+	{
+		fprintf(stderr, "Cannot grow the memory to %zu cells\n", m->size);
+		abort();
+	}
+	memset(m->written, 0, npages);
+	memset(m->written, 1, (img->psize + PAGE_CELLS - 1) >> PAGE_SHIFT);
+	memset(m->dirty, 0, npages);
+	sparse_clear(&m->far);
+
+	/* NOTE: the image was verified when it was loaded */
+	m->near_lo = img->near_lo;
+	m->near_hi = img->near_hi;
+	m->near = img->near;
+	m->near_misses = 0;
+	module_start(m, img->prog, img->psize);
+}
+
+void module_start(struct module *m, const int64_t *prog, size_t psize)
+{
+	/* NOTE: the translated program replaces the JIT */
+	m->native = natives;
+	while (m->native && (m->native->isize != psize ||
+			     memcmp(m->native->image, prog, psize * sizeof(*prog))))
+	{
+		m->native = m->native->next;
+	}
+#ifdef INTCODE_JIT
+	if (!m->native)
+	{
+		jit_load(m, prog, psize);
+	}
+	else if (m->jit)
+	{
+		jit_free(m->jit);
+		m->jit = NULL;
+	}
+#endif
+
+#ifdef INTCODE_PROFILE
+	profile_load(m, psize);
+#endif
+	if (m->memo)
+	{
+		memo_load(m, psize);
+	}
+
+	m->pc = 0;
+	m->rbp = 0;
+	m->in.r = m->in.w = 0;
+	m->out.r = m->out.w = 0;
+	m->idle_reads = 0;
+	m->steps = 0;
+
+	snapshot_free(m->base);
+	m->base = NULL;
+}
+
+/* the pages written since the base snapshot are still written since
+ * the last load */
+static void module_clean(struct module *m, size_t npages)
+{
+	for (size_t i = 0; i < npages; i++)
+	{
+		m->written[i] |= m->dirty[i];
+	}
+	memset(m->dirty, 0, npages);
+}
+
+/* copy of the page i of the memory, NULL if it contains only zeros */
+static struct page *page_save(struct module *m, size_t i)
+{
+	const int64_t *cell = m->ram + (i << PAGE_SHIFT);
+	size_t k = 0;
+	while (k < PAGE_CELLS && cell[k] == 0)
+	{
+		k++;
+	}
+	if (k == PAGE_CELLS)
+	{
+		return NULL;
+	}
+
+	struct page *p = malloc(sizeof(*p));
+	if (!p)
+	{
+		fprintf(stderr, "Cannot allocate a page\n");
+		abort();
+	}
+	p->refs = 1;
+	memcpy(p->cell, cell, sizeof(p->cell));
+	return p;
+}
+
+/* copy a page of the snapshot back into the page i of the memory */
+static void page_restore(struct module *m, size_t i, const struct page *p)
+{
+	int64_t addr = i << PAGE_SHIFT;
+	int64_t *cell = m->ram + addr;
+	if ((uint64_t)addr >= m->ncode)
+	{
+		if (p)
+		{
+			memcpy(cell, p->cell, sizeof(p->cell));
+		}
+		else
+		{
+			memset(cell, 0, sizeof(p->cell));
+		}
+		return;
+	}
+
+	/* NOTE: only the program cells that changed are
+	 * invalidated */
+	for (size_t k = 0; k < PAGE_CELLS; k++)
+	{
+		int64_t v = p ? p->cell[k] : 0;
+		if (cell[k] != v)
+		{
+			cell[k] = v;
+			if ((uint64_t)(addr + k) < m->ncode)
+			{
+				module_invalidate(m, addr + k);
+			}
+		}
+	}
+}
+
+static struct page *snapshot_page(const struct snapshot *s, size_t i)
+{
+	return i < s->npages ? s->pages[i] : NULL;
+}
+
+struct snapshot *module_snapshot(struct module *m)
+{
+	/* NOTE: the memory might be still unallocated */
+	if (!m->size)
+	{
+		module_grow(m, 0);
+	}
+
+	size_t npages = m->size >> PAGE_SHIFT;
+	struct snapshot *s = calloc(1, sizeof(*s));
+	struct page **pages = malloc(npages * sizeof(*pages));
+	struct farpage *far = malloc(m->far.count * TABLE_PAGES * sizeof(*far));
+	if (!s || !pages || (m->far.count && !far))
+	{
+		free(far);
+		free(pages);
+		free(s);
+		return NULL;
+	}
+
+	/* the pages that were not written since the base are
+	 * shared with it */
+	struct snapshot *base = m->base;
+	for (size_t i = 0; i < npages; i++)
+	{
+		struct page *p;
+		if (base && !m->dirty[i])
+		{
+			p = snapshot_page(base, i);
+			if (p)
+			{
+				p->refs++;
+			}
+		}
+		else
+		{
+			p = page_save(m, i);
+		}
+		pages[i] = p;
+	}
+
+	/* the sparse pages are shared, the module copies them
+	 * before writing */
+	size_t nfar = 0;
+	for (size_t h = 0; h < m->far.cap; h++)
+	{
+		struct table *t = m->far.slot[h];
+		for (size_t k = 0; t && k < TABLE_PAGES; k++)
+		{
+			if (t->page[k])
+			{
+				t->page[k]->refs++;
+				far[nfar].index = (t->key << TABLE_SHIFT) | k;
+				far[nfar].page = t->page[k];
+				nfar++;
+			}
+		}
+	}
+
+	s->refs = 2;		/* the caller and the module */
+	s->pages = pages;
+	s->npages = npages;
+	s->far = far;
+	s->nfar = nfar;
+	s->ncode = m->ncode;
+	s->near_lo = m->near_lo;
+	s->near_hi = m->near_hi;
+	s->pc = m->pc;
+	s->rbp = m->rbp;
+	queue_assign(&s->in, &m->in);
+	queue_assign(&s->out, &m->out);
+	s->idle_reads = m->idle_reads;
+	s->steps = m->steps;
+
+	snapshot_free(m->base);
+	m->base = s;
+	module_clean(m, npages);
+	return s;
+}
+
+void module_restore(struct module *m, struct snapshot *s)
+{
+	if ((s->npages << PAGE_SHIFT) > m->size)
+	{
+		module_grow(m, (s->npages << PAGE_SHIFT) - 1);
+	}
+
+	/* copy only the pages written since the base and the ones
+	 * where the base and the snapshot differ */
+	size_t npages = m->size >> PAGE_SHIFT;
+	struct snapshot *base = m->base;
+	for (size_t i = 0; i < npages; i++)
+	{
+		struct page *p = snapshot_page(s, i);
+		if (!base || m->dirty[i] || p != snapshot_page(base, i))
+		{
+			page_restore(m, i, p);
+			m->written[i] = 1;
+		}
+	}
+
+	m->pc = s->pc;
+	m->rbp = s->rbp;
+	if (m->near_lo != s->near_lo || m->near_hi != s->near_hi)
+	{
+		m->near_lo = s->near_lo;
+		m->near_hi = s->near_hi;
+		m->near = 0;
+		module_recode(m);
+	}
+	module_check_window(m);
+	queue_assign(&m->in, &s->in);
+	queue_assign(&m->out, &s->out);
+	m->idle_reads = s->idle_reads;
+	m->steps = s->steps;
+
+	s->refs++;
+	snapshot_free(m->base);
+	m->base = s;
+	module_clean(m, npages);
+
+	sparse_clear(&m->far);
+	for (size_t i = 0; i < s->nfar; i++)
+	{
+		struct farpage *f = s->far + i;
+		if (f->index < npages)
+		{
+			/* NOTE: the dense memory grew over the page
+			 * after the snapshot was taken, it differs
+			 * from the base */
+			page_restore(m, f->index, f->page);
+			m->dirty[f->index] = 1;
+		}
+		else
+		{
+			f->page->refs++;
+			*sparse_page(&m->far, f->index << PAGE_SHIFT, 1) = f->page;
+		}
+	}
+}
+
+struct module *module_fork(struct snapshot *s)
+{
+	struct module *m = module_new();
+	if (!m)
+	{
+		return NULL;
+	}
+
+	/* NOTE: the decoded program starts stale, the native code
+	 * is bound to a loaded program and the fork is always
+	 * interpreted */
+	m->code = calloc(s->ncode, sizeof(*m->code));
+	if (s->ncode && !m->code)
+	{
+		free(m);
+		return NULL;
+	}
+	m->ncode = m->csize = s->ncode;
+	module_grow(m, s->ncode + 3);
+#ifdef INTCODE_PROFILE
+	profile_load(m, s->ncode);
+#endif
+	module_restore(m, s);
+	return m;
+}
+
+void snapshot_free(struct snapshot *s)
+{
+	if (s && --s->refs == 0)
+	{
+		for (size_t i = 0; i < s->npages; i++)
+		{
+			struct page *p = s->pages[i];
+			if (p && --p->refs == 0)
+			{
+				free(p);
+			}
+		}
+		for (size_t i = 0; i < s->nfar; i++)
+		{
+			if (--s->far[i].page->refs == 0)
+			{
+				free(s->far[i].page);
+			}
+		}
+		free(s->far);
+		free(s->pages);
+		free(s->in.buf);
+		free(s->out.buf);
+		free(s);
+	}
+}
+
+void module_push_input(struct module *m, int64_t value)
+{
+	queue_push(&m->in, value);
+}
+
+void module_push_inputs(struct module *m, const int64_t *values, size_t count)
+{
+	queue_write(&m->in, values, count);
+}
+
+int64_t module_pop_output(struct module *m)
+{
+	assert(m->out.w != m->out.r);
+	return queue_pop(&m->out);
+}
+
+size_t module_pop_outputs(struct module *m, int64_t *values, size_t count)
+{
+	size_t len = m->out.w - m->out.r;
+	if (count > len)
+	{
+		count = len;
+	}
+	queue_read(&m->out, values, count);
+	m->out.r += count;
+	return count;
+}
+
+int64_t module_peek_output(struct module *m)
+{
+	assert(m->out.w != m->out.r);
+	return m->out.buf[m->out.r & (m->out.cap - 1)];
+}
+
+int module_output_empty(struct module *m)
+{
+	return m->out.r == m->out.w;
+}
+
+size_t module_output_len(struct module *m)
+{
+	return m->out.w - m->out.r;
+}
+
+void module_idle_input(struct module *m, int64_t value, unsigned count)
+{
+	m->idle_value = value;
+	m->idle_limit = count;
+	m->idle_reads = 0;
+}
+
+void module_io(struct module *m, module_input_fn input,
+	       module_output_fn output, void *ctx)
+{
+	m->input = input;
+	m->output = output;
+	m->io_ctx = ctx;
+}
+
+struct channel *channel_new(void)
+{
+	return calloc(1, sizeof(struct channel));
+}
+
+void channel_free(struct channel *c)
+{
+	if (c)
+	{
+		free(c->q.buf);
+		free(c);
+	}
+}
+
+void channel_wake(struct channel *c, channel_wake_fn wake, void *ctx)
+{
+	c->wake = wake;
+	c->wake_ctx = ctx;
+}
+
+void channel_push(struct channel *c, int64_t value)
+{
+	int empty = c->q.w == c->q.r;
+	queue_push(&c->q, value);
+	if (empty && c->wake)
+	{
+		c->wake(c->wake_ctx, c);
+	}
+}
+
+int64_t channel_pop(struct channel *c)
+{
+	assert(c->q.w != c->q.r);
+	return queue_pop(&c->q);
+}
+
+size_t channel_len(const struct channel *c)
+{
+	return c->q.w - c->q.r;
+}
+
+void module_connect(struct module *producer, struct channel *c,
+		    struct module *consumer)
+{
+	if (producer)
+	{
+		producer->cout = c;
+	}
+	if (consumer)
+	{
+		consumer->cin = c;
+	}
+}
+
+void module_memoize(struct module *m, int enable)
+{
+	if (enable && !m->memo)
+	{
+		m->memo = calloc(1, sizeof(*m->memo));
+		if (!m->memo)
+		{
+			fprintf(stderr, "Cannot allocate the call cache\n");
+			abort();
+		}
+	}
+	else if (!enable)
+	{
+		memo_free(m->memo);
+		m->memo = NULL;
+	}
+}
+
+void module_log(struct module *m, FILE *out)
+{
+	m->echo = out;
+}
+
+static inline void store(struct module *m, int64_t addr, int64_t value)
+{
+	m->ram[addr] = value;
+	m->dirty[addr >> PAGE_SHIFT] = 1;
+	if ((uint64_t)addr < m->ncode)
+	{
+		module_invalidate(m, addr);
+	}
+}
+
+static void store_far(struct module *m, int64_t addr, int64_t value)
+{
+	if (addr < 0)
+	{
+		invalid_address(m, addr);
+	}
+	else if (addr < DENSE_CELLS)
+	{
+		module_grow(m, addr);
+		store(m, addr, value);
+	}
+	else
+	{
+		sparse_store(&m->far, addr, value);
+	}
+}
+
+static inline void store_at(struct module *m, int64_t addr, int64_t value)
+{
+	if ((uint64_t)addr < m->size)
+	{
+		store(m, addr, value);
+	}
+	else
+	{
+		store_far(m, addr, value);
+	}
+}
+
+int64_t module_peek(struct module *m, int64_t addr)
+{
+	return load(m, addr);
+}
+
+void module_poke(struct module *m, int64_t addr, int64_t value)
+{
+	store_at(m, addr, value);
+}
+
+static void module_echo(struct module *m, int64_t value)
+{
+	if (m->echo && 0 <= value && value < 256)
+	{
+		putc(value, m->echo);
+	}
+}
+
+/* returns -1 if the next input is available, the state otherwise */
+static inline int input(struct module *m, int64_t *value)
+{
+	if (m->in.w != m->in.r)
+	{
+		*value = queue_pop(&m->in);
+		m->idle_reads = 0;
+		return -1;
+	}
+	if (m->cin && m->cin->q.w != m->cin->q.r)
+	{
+		*value = queue_pop(&m->cin->q);
+		m->idle_reads = 0;
+		return -1;
+	}
+	if (m->input && m->input(m->io_ctx, value))
+	{
+		m->idle_reads = 0;
+		return -1;
+	}
+	if (m->idle_reads < m->idle_limit)
+	{
+		*value = m->idle_value;
+		m->idle_reads++;
+		return -1;
+	}
+	return m->idle_limit ? INPUT_IDLE : INPUT_EMPTY;
+}
+
+static inline void output(struct module *m, int64_t value)
+{
+	if (m->cout)
+	{
+		channel_push(m->cout, value);
+	}
+	else if (m->output)
+	{
+		m->output(m->io_ctx, value);
+	}
+	else
+	{
+		queue_push(&m->out, value);
+	}
+	m->idle_reads = 0;
+}
+
+int64_t native_load(struct module *m, int64_t addr)
+{
+	return load(m, addr);
+}
+
+void native_store(struct module *m, int64_t addr, int64_t value)
+{
+	store_at(m, addr, value);
+}
+
+int native_input(struct module *m, int64_t *value)
+{
+	int status = input(m, value);
+	if (status < 0)
+	{
+		module_echo(m, *value);
+	}
+	return status;
+}
+
+void native_output(struct module *m, int64_t value)
+{
+	output(m, value);
+	module_echo(m, value);
+}
+
+static inline int64_t load_arg(struct module *m, const struct insn *i, int k)
+{
+	switch (i->kind[k])
+	{
+	case ARG_IMM: return i->arg[k];
+	case ARG_ABS: return m->ram[i->arg[k]];
+	case ARG_NEAR: return m->ram[m->rbp + i->arg[k]];
+	case ARG_REL: return load(m, m->rbp + i->arg[k]);
+	default:      return load(m, i->arg[k]);
+	}
+}
+
+static inline void store_arg(struct module *m, const struct insn *i, int k,
+			     int64_t value)
+{
+	switch (i->kind[k])
+	{
+	case ARG_ABS: store(m, i->arg[k], value); break;
+	case ARG_NEAR: store(m, m->rbp + i->arg[k], value); break;
+	case ARG_REL: store_at(m, m->rbp + i->arg[k], value); break;
+	default:      store_at(m, i->arg[k], value); break;
+	}
+}
+
+/* fetch the decoded instruction at pc */
+static inline struct insn *fetch(struct module *m, struct insn *tmp)
+{
+	struct insn *i;
+	if ((uint64_t)m->pc < m->ncode)
+	{
+		i = m->code + m->pc;
+		if (i->op == INSN_STALE)
+		{
+			module_decode(m, m->pc, i);
+			module_fuse(m, m->pc, i);
+		}
+	}
+	else
+	{
+		/* NOTE: code outside of the program is decoded
+		 * every time, from a copy because it might span
+		 * the dense and the sparse memory */
+		int64_t cell[4];
+		for (int k = 0; k < 4; k++)
+		{
+			cell[k] = load(m, m->pc + k);
+		}
+		i = tmp;
+		insn_decode(i, cell, m->size);
+	}
+	return i;
+}
+
+/*
+ * The handlers are written once and dispatched either by a switch or,
+ * with GCC and clang, by threaded code: every handler ends with its
+ * own indirect jump to the next one so that the branch predictor can
+ * learn the opcode sequences. Define INTCODE_SWITCH to force the
+ * portable dispatch.
+ */
+#if defined(__GNUC__) && !defined(INTCODE_SWITCH)
+#define INTCODE_THREADED
+#endif
+
+#ifdef INTCODE_JIT
+/* internal state, native code is available at pc */
+#define JIT_PENDING	-1
+
+/* leave the interpreter after a taken jump to native code */
+#define JIT_ENTER()	do { if (m->jit && jit_ready(m, m->pc)) { steps++; status = JIT_PENDING; goto out; } } while (0)
+#else
+#define JIT_ENTER()	do { } while (0)
+#endif
+
+#ifdef INTCODE_PROFILE
+#define PROFILE_INSN()		profile_insn(m, i)
+#define PROFILE_BRANCH(taken)	profile_branch(m, taken)
+#else
+#define PROFILE_INSN()		do { } while (0)
+#define PROFILE_BRANCH(taken)	do { } while (0)
+#endif
+
+/* internal state, the translated program can continue at pc */
+#define NATIVE_PENDING	-2
+
+#define NATIVE_ENTER()	do { if (m->native && native_ready(m, m->pc)) { steps++; status = NATIVE_PENDING; goto out; } } while (0)
+
+#ifdef INTCODE_THREADED
+#define TARGET(op)	target_##op: case op
+#define DISPATCH()	do { steps++; i = fetch(m, &tmp); PROFILE_INSN(); goto *dispatch[i->op]; } while (0)
+#else
+#define TARGET(op)	case op
+#define DISPATCH()	continue
+#endif
+
+static int interpret(struct module *m)
+{
+#ifdef INTCODE_THREADED
+	static const void *const dispatch[256] = {
+		[0 ... 255] = &&target_INSN_FAULT,
+		[OP_ADD] = &&target_OP_ADD,
+		[OP_MUL] = &&target_OP_MUL,
+		[OP_IN] = &&target_OP_IN,
+		[OP_OUT] = &&target_OP_OUT,
+		[OP_JNZ] = &&target_OP_JNZ,
+		[OP_JZ] = &&target_OP_JZ,
+		[OP_TLT] = &&target_OP_TLT,
+		[OP_TEQ] = &&target_OP_TEQ,
+		[OP_ARB] = &&target_OP_ARB,
+		[OP_HALT] = &&target_OP_HALT,
+		[INSN_TLT_JNZ] = &&target_INSN_TLT_JNZ,
+		[INSN_TLT_JZ] = &&target_INSN_TLT_JZ,
+		[INSN_TEQ_JNZ] = &&target_INSN_TEQ_JNZ,
+		[INSN_TEQ_JZ] = &&target_INSN_TEQ_JZ,
+		[INSN_ARB_JMP] = &&target_INSN_ARB_JMP,
+	};
+#endif
+	struct insn *i, tmp;
+	int64_t a, b;
+	uint64_t steps = 0;
+	int status;
+
+	for (;;)
+	{
+		steps++;
+		i = fetch(m, &tmp);
+		PROFILE_INSN();
+		switch (i->op)
+		{
+		TARGET(OP_ADD):
+			a = load_arg(m, i, 0);
+			b = load_arg(m, i, 1);
+			store_arg(m, i, 2, a + b);
+			m->pc += 4;
+			DISPATCH();
+
+		TARGET(OP_MUL):
+			a = load_arg(m, i, 0);
+			b = load_arg(m, i, 1);
+			store_arg(m, i, 2, a * b);
+			m->pc += 4;
+			DISPATCH();
+
+		TARGET(OP_IN):
+			status = input(m, &b);
+			if (status >= 0)
+			{
+				goto out;
+			}
+			store_arg(m, i, 0, b);
+			m->pc += 2;
+			module_echo(m, b);
+			DISPATCH();
+
+		TARGET(OP_OUT):
+			a = load_arg(m, i, 0);
+			output(m, a);
+			m->pc += 2;
+			module_echo(m, a);
+			DISPATCH();
+
+		TARGET(OP_JNZ):
+			a = load_arg(m, i, 0);
+			PROFILE_BRANCH(a != 0);
+			if (a != 0)
+			{
+				m->pc = load_arg(m, i, 1);
+				JIT_ENTER();
+				NATIVE_ENTER();
+			}
+			else
+			{
+				m->pc += 3;
+			}
+			DISPATCH();
+
+		TARGET(OP_JZ):
+			a = load_arg(m, i, 0);
+			PROFILE_BRANCH(a == 0);
+			if (a == 0)
+			{
+				m->pc = load_arg(m, i, 1);
+				JIT_ENTER();
+				NATIVE_ENTER();
+			}
+			else
+			{
+				m->pc += 3;
+			}
+			DISPATCH();
+
+		TARGET(OP_TLT):
+			a = load_arg(m, i, 0);
+			b = load_arg(m, i, 1);
+			store_arg(m, i, 2, a < b ? 1 : 0);
+			m->pc += 4;
+			DISPATCH();
+
+		TARGET(OP_TEQ):
+			a = load_arg(m, i, 0);
+			b = load_arg(m, i, 1);
+			store_arg(m, i, 2, a == b ? 1 : 0);
+			m->pc += 4;
+			DISPATCH();
+
+		TARGET(OP_ARB):
+			m->rbp += load_arg(m, i, 0);
+			module_check_window(m);
+			m->pc += 2;
+			DISPATCH();
+
+		/*
+		 * The superinstructions retire both instructions
+		 * with one dispatch. The first one can make them
+		 * stale (a write into their cells, or rbp moving the
+		 * window), then the second one is dispatched alone.
+		 */
+		TARGET(INSN_TLT_JNZ):
+			a = load_arg(m, i, 0);
+			b = load_arg(m, i, 1);
+			a = a < b ? 1 : 0;
+			goto fused_jnz;
+
+		TARGET(INSN_TEQ_JNZ):
+			a = load_arg(m, i, 0);
+			b = load_arg(m, i, 1);
+			a = a == b ? 1 : 0;
+		fused_jnz:
+			store_arg(m, i, 2, a);
+			m->pc += 4;
+			if (i->op == INSN_STALE)
+			{
+				DISPATCH();
+			}
+			steps++;
+			i += 4;
+			PROFILE_BRANCH(a != 0);
+			if (a != 0)
+			{
+				m->pc = load_arg(m, i, 1);
+				JIT_ENTER();
+				NATIVE_ENTER();
+			}
+			else
+			{
+				m->pc += 3;
+			}
+			DISPATCH();
+
+		TARGET(INSN_TLT_JZ):
+			a = load_arg(m, i, 0);
+			b = load_arg(m, i, 1);
+			a = a < b ? 1 : 0;
+			goto fused_jz;
+
+		TARGET(INSN_TEQ_JZ):
+			a = load_arg(m, i, 0);
+			b = load_arg(m, i, 1);
+			a = a == b ? 1 : 0;
+		fused_jz:
+			store_arg(m, i, 2, a);
+			m->pc += 4;
+			if (i->op == INSN_STALE)
+			{
+				DISPATCH();
+			}
+			steps++;
+			i += 4;
+			PROFILE_BRANCH(a == 0);
+			if (a == 0)
+			{
+				m->pc = load_arg(m, i, 1);
+				JIT_ENTER();
+				NATIVE_ENTER();
+			}
+			else
+			{
+				m->pc += 3;
+			}
+			DISPATCH();
+
+		TARGET(INSN_ARB_JMP):
+			m->rbp += load_arg(m, i, 0);
+			module_check_window(m);
+			m->pc += 2;
+			if (i->op == INSN_STALE)
+			{
+				DISPATCH();
+			}
+			steps++;
+			i += 2;
+			PROFILE_BRANCH(1);
+			m->pc = load_arg(m, i, 1);
+			JIT_ENTER();
+			NATIVE_ENTER();
+			DISPATCH();
+
+		TARGET(OP_HALT):
+			status = HALTED;
+			goto out;
+
+		TARGET(INSN_FAULT):
+		default:
+			module_fault(m);
+		}
+	}
+
+out:
+	/* NOTE: the instruction that stopped the interpreter is not
+	 * retired */
+	m->steps += steps - 1;
+	return status;
+}
+
+#undef TARGET
+#undef DISPATCH
+#undef JIT_ENTER
+#undef NATIVE_ENTER
+#undef PROFILE_INSN
+#undef PROFILE_BRANCH
+
+/* operands of interpret_memo(), the cache sees every access */
+static inline int64_t memo_arg(struct module *m, const struct insn *i, int k)
+{
+	int64_t value = load_arg(m, i, k);
+	if (i->kind[k] == ARG_REL || i->kind[k] == ARG_NEAR)
+	{
+		memo_read(m, m->rbp + i->arg[k], value);
+	}
+	else if (i->kind[k] != ARG_IMM)
+	{
+		memo_global(m);
+	}
+	return value;
+}
+
+static inline void memo_store_arg(struct module *m, const struct insn *i, int k,
+				  int64_t value)
+{
+	if (i->kind[k] == ARG_REL || i->kind[k] == ARG_NEAR)
+	{
+		memo_write(m, m->rbp + i->arg[k], value);
+	}
+	else
+	{
+		memo_global(m);
+	}
+	store_arg(m, i, k, value);
+}
+
+/*
+ * Interpreter of module_memoize(), one instruction at a time: the
+ * superinstructions run as their first instruction and the taken
+ * jumps to constant addresses are checked for calls.
+ */
+static int interpret_memo(struct module *m)
+{
+	struct insn *i, tmp;
+	int64_t a, b;
+	uint64_t steps = 0;
+	int status;
+
+	for (;;)
+	{
+		while (memo_returned(m))
+		{
+			memo_return(m, steps);
+		}
+
+		i = fetch(m, &tmp);
+		int op = insn_unfused(i->op);
+		memo_code(m, m->pc, op == OP_HALT ? 1 : op_args[op] + 1);
+		switch (op)
+		{
+		case OP_ADD:
+		case OP_MUL:
+		case OP_TLT:
+		case OP_TEQ:
+			a = memo_arg(m, i, 0);
+			b = memo_arg(m, i, 1);
+			a = op == OP_ADD ? a + b
+				: op == OP_MUL ? a * b
+				: op == OP_TLT ? a < b
+				: a == b;
+			memo_store_arg(m, i, 2, a);
+			m->pc += 4;
+			break;
+
+		case OP_IN:
+			memo_global(m);
+			status = input(m, &b);
+			if (status >= 0)
+			{
+				goto out;
+			}
+			store_arg(m, i, 0, b);
+			m->pc += 2;
+			module_echo(m, b);
+			break;
+
+		case OP_OUT:
+			memo_global(m);
+			a = load_arg(m, i, 0);
+			output(m, a);
+			m->pc += 2;
+			module_echo(m, a);
+			break;
+
+		case OP_JNZ:
+		case OP_JZ:
+			a = memo_arg(m, i, 0);
+			if ((a != 0) == (op == OP_JNZ))
+			{
+				int64_t ret = m->pc + 3;
+				int call = i->kind[1] == ARG_IMM && load(m, m->rbp) == ret;
+				m->pc = memo_arg(m, i, 1);
+				steps++;
+				if (call)
+				{
+					memo_call(m, ret, &steps);
+				}
+				continue;
+			}
+			m->pc += 3;
+			break;
+
+		case OP_ARB:
+			m->rbp += memo_arg(m, i, 0);
+			module_check_window(m);
+			m->pc += 2;
+			break;
+
+		case OP_HALT:
+			status = HALTED;
+			goto out;
+
+		default:
+			module_fault(m);
+		}
+		steps++;
+	}
+
+out:
+	m->steps += steps;
+	memo_stop(m);
+	return status;
+}
+
+int module_execute(struct module *m)
+{
+	int status;
+	if (m->memo && m->memo->isize)
+	{
+		return interpret_memo(m);
+	}
+	for (;;)
+	{
+		if (m->native && native_ready(m, m->pc))
+		{
+			status = m->native->run(m);
+			module_check_window(m);
+			if (status != NATIVE_EXIT)
+			{
+				return status;
+			}
+		}
+		status = interpret(m);
+#ifdef INTCODE_JIT
+		if (status == JIT_PENDING)
+		{
+			jit_run(m);
+			module_check_window(m);
+			continue;
+		}
+#endif
+		if (status != NATIVE_PENDING)
+		{
+			return status;
+		}
+	}
+}
+
+uint64_t module_steps(struct module *m)
+{
+	return m->steps;
+}
+
+int64_t *program_load(FILE *input, size_t *count)
+{
+	int64_t *array = NULL;
+	size_t acount = 0;
+	size_t asize = 0;
+
+	int64_t value;
+	while (fscanf(input, "%" SCNd64 ",", &value) == 1)
+	{
+		if (acount == asize)
+		{
+			size_t newsize = asize ? asize * 2 : 32;
+			int64_t *newarray = realloc(array, newsize * sizeof(*newarray));
+			if (!newarray)
+			{
+				free(array);
+				return NULL;
+			}
+			asize = newsize;
+			array = newarray;
+		}
+		array[acount++] = value;
+	}
+	*count = acount;
+	return array;
+}
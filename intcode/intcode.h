@@ -0,0 +1,207 @@
+#ifndef INTCODE_H
+#define INTCODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum
+{
+	/* opcodes */
+	OP_ADD	= 1,		/* [c] = [a] + [b]        */
+	OP_MUL	= 2,		/* [c] = [a] * [b]        */
+	OP_IN	= 3,		/* [a] = <input>          */
+	OP_OUT	= 4,		/* output([a])            */
+	OP_JNZ	= 5,		/* if ([a] != 0) goto [b] */
+	OP_JZ	= 6,		/* if ([a] == 0) goto [b] */
+	OP_TLT	= 7,		/* [c] = [a] < [b]        */
+	OP_TEQ	= 8,		/* [c] = [a] == [b]       */
+	OP_ARB  = 9,		/* rbp += [a]             */
+	OP_HALT = 99,
+
+	/* addressing modes */
+	PMODE = 0,		/* absolute index */
+	IMODE = 1,		/* immediate literal */
+	RMODE = 2,		/* relative index (to rbp) */
+
+	/* state of the execution */
+	INPUT_EMPTY = 0,
+	INPUT_IDLE = 1,		/* see module_idle_input() */
+	HALTED = 2,
+};
+
+struct module;
+struct snapshot;
+
+/* allocate an empty module, the memory grows on demand and the cells
+ * at high addresses take memory only for the pages that are written */
+struct module *module_new(void);
+
+/* release the module and its memory */
+void module_free(struct module *m);
+
+/* reset the module and copy the program at address 0 */
+void module_load(struct module *m, const int64_t *prog, size_t psize);
+
+/*
+ * Program shared by many modules: it is loaded and decoded once, then
+ * the modules loaded from the image share its memory and its decoded
+ * instructions and take their own copy only of the pages they write
+ * (on Linux, elsewhere they copy the whole image). The modules keep
+ * the image alive after image_free().
+ */
+struct image;
+struct image *image_new(const int64_t *prog, size_t psize);
+void image_free(struct image *img);
+
+/* same as module_load() with the program of the image */
+void module_load_image(struct module *m, struct image *img);
+
+/*
+ * run the program until it needs an input that is not available or
+ * the program halts; returns the corresponding state.
+ */
+int module_execute(struct module *m);
+
+/* number of instructions retired since the last module_load() */
+uint64_t module_steps(struct module *m);
+
+/* input queue, it grows as needed */
+void module_push_input(struct module *m, int64_t value);
+void module_push_inputs(struct module *m, const int64_t *values, size_t count);
+
+/* output queue, it grows as needed; module_pop_outputs() moves up to
+ * count values and returns how many */
+int64_t module_pop_output(struct module *m);
+size_t module_pop_outputs(struct module *m, int64_t *values, size_t count);
+int64_t module_peek_output(struct module *m);
+int module_output_empty(struct module *m);
+size_t module_output_len(struct module *m);
+
+/*
+ * when the input queue is empty feed value to the program instead, up
+ * to count times in a row without any output in between; then stop
+ * with INPUT_IDLE until more input is pushed. A count of 0 (the
+ * default) stops with INPUT_EMPTY at once.
+ */
+void module_idle_input(struct module *m, int64_t value, unsigned count);
+
+/*
+ * Callbacks that complete the I/O without leaving the interpreter:
+ * input() is called when the input queue is empty, it stores the next
+ * input in value and returns 1, or it returns 0 to fall back to the
+ * idle input or to stop; output() receives the outputs instead of the
+ * output queue. Either can be NULL. They must not load, restore or
+ * execute the module.
+ */
+typedef int (*module_input_fn)(void *ctx, int64_t *value);
+typedef void (*module_output_fn)(void *ctx, int64_t value);
+void module_io(struct module *m, module_input_fn input,
+	       module_output_fn output, void *ctx);
+
+/*
+ * A channel carries the outputs of a module straight to the input of
+ * another one: the OUT instructions of the producer write into it and
+ * the IN instructions of the consumer read from it once its own input
+ * queue is empty, without going through the host. The host can push
+ * and pop values too, e.g. to start a chain or to read its result.
+ * wake() is called when a value is written into the empty channel, so
+ * that a scheduler can run the consumer again; like the I/O callbacks
+ * it must not load, restore or execute a module. The channels belong to
+ * the caller: they survive module_load() and they are not saved by
+ * the snapshots. A channel is not thread safe.
+ */
+struct channel;
+typedef void (*channel_wake_fn)(void *ctx, struct channel *c);
+struct channel *channel_new(void);
+void channel_free(struct channel *c);
+void channel_wake(struct channel *c, channel_wake_fn wake, void *ctx);
+void channel_push(struct channel *c, int64_t value);
+int64_t channel_pop(struct channel *c);
+size_t channel_len(const struct channel *c);
+
+/* connect the output of producer to the input of consumer through c,
+ * either module can be NULL; a NULL channel disconnects both */
+void module_connect(struct module *producer, struct channel *c,
+		    struct module *consumer);
+
+/*
+ * cache the subroutine calls that read and write only cells relative
+ * to rbp and do no I/O, so that a call repeated with the same values
+ * in those cells returns at once; the JIT and the translated programs
+ * are not used while the cache is enabled. It takes effect from the
+ * next module_load().
+ */
+void module_memoize(struct module *m, int enable);
+
+/* echo the ASCII input and output of the program to out */
+void module_log(struct module *m, FILE *out);
+
+/* direct access to the memory of the module */
+int64_t module_peek(struct module *m, int64_t addr);
+void module_poke(struct module *m, int64_t addr, int64_t value);
+
+/*
+ * save the whole state of the module; the pages of memory that were
+ * not written since the last snapshot or restore of the module are
+ * shared with that snapshot. Returns NULL on error.
+ */
+struct snapshot *module_snapshot(struct module *m);
+
+/* rewind the module, only the pages that differ are copied */
+void module_restore(struct module *m, struct snapshot *s);
+
+/* new module in the state saved by the snapshot */
+struct module *module_fork(struct snapshot *s);
+
+/* release the snapshot, the modules based on it keep it alive */
+void snapshot_free(struct snapshot *s);
+
+/*
+ * run count instances of the program in lockstep: instance k reads the
+ * ninputs values at inputs + k*ninputs and writes up to noutputs
+ * values at outputs + k*noutputs, the missing ones are 0. An instance
+ * stops when it halts, when it needs more input or when its outputs
+ * are full. The instructions before the first input run only once and
+ * every instance starts from the state they leave.
+ */
+void program_batch(const int64_t *prog, size_t psize, size_t count,
+		   const int64_t *inputs, size_t ninputs,
+		   int64_t *outputs, size_t noutputs);
+
+/*
+ * Symbolic execution of a program: the cells at the addresses in
+ * cells[0..ncells) hold the symbols 0..ncells-1, the program reads the
+ * ninputs values first and then each input is a new symbol. It runs
+ * until it halts and every cell and output is left as an expression
+ * over the symbols. It fails and returns NULL if the opcodes, the
+ * jumps, rbp or the written addresses depend on the symbols, i.e. if
+ * the program might take another path with other values, or if it
+ * does not halt within max_steps instructions.
+ */
+struct symbolic;
+struct expr;
+struct symbolic *program_symbolic(const int64_t *prog, size_t psize,
+				  const int64_t *cells, size_t ncells,
+				  const int64_t *inputs, size_t ninputs,
+				  uint64_t max_steps);
+void symbolic_free(struct symbolic *s);
+
+/* number of symbols and of outputs */
+size_t symbolic_symbols(const struct symbolic *s);
+size_t symbolic_outputs(const struct symbolic *s);
+
+/* the expression of the output k or of the final value of a cell,
+ * NULL if it depends on a read through a symbolic address or if it is
+ * too long */
+struct expr *symbolic_output(const struct symbolic *s, size_t k);
+struct expr *symbolic_cell(const struct symbolic *s, int64_t addr);
+
+/* value of the expression with the given values of the symbols */
+int64_t expr_eval(const struct expr *e, const int64_t *symbols);
+void expr_free(struct expr *e);
+
+/* read a comma separated program, returns NULL on error */
+int64_t *program_load(FILE *input, size_t *count);
+
+#endif
@@ -0,0 +1,751 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "module.h"
+#include "jit.h"
+
+#ifdef INTCODE_JIT
+
+/* size of the executable buffer */
+#define JIT_BUFFER_SIZE (4 << 20)
+
+/* maximum number of instructions in a block */
+#define JIT_MAX_INSNS 64
+
+/* upper bound of the native code of a single instruction */
+#define JIT_INSN_BYTES 384
+
+/* stop compiling after too many writes into native code */
+#define JIT_MAX_FLUSHES 64
+
+enum
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+/* registers that hold the state of the module in native code */
+#define REG_RAM		R12	/* m->ram */
+#define REG_SIZE	RBX	/* m->size */
+#define REG_RBP		R13	/* m->rbp */
+#define REG_M		R14	/* m */
+#define REG_ENTRY	R15	/* m->jit->entry */
+#define REG_DIRTY	RBP	/* m->dirty */
+
+/* condition codes */
+enum
+{
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_L = 0xc,
+};
+
+struct stub
+{
+	uint8_t *rel;		/* jump to patch */
+	int64_t pc;		/* instruction to resume from */
+	unsigned retired;	/* instructions retired so far */
+};
+
+struct emitter
+{
+	struct module *m;
+	uint8_t *p;
+
+	int64_t start;		/* address of the block */
+	uint8_t *entry;		/* native code of the block */
+
+	struct stub stubs[JIT_MAX_INSNS * 4];
+	size_t nstubs;
+};
+
+static void emit8(struct emitter *e, uint8_t v)
+{
+	*e->p++ = v;
+}
+
+static void emit32(struct emitter *e, uint32_t v)
+{
+	memcpy(e->p, &v, sizeof(v));
+	e->p += sizeof(v);
+}
+
+static void emit64(struct emitter *e, uint64_t v)
+{
+	memcpy(e->p, &v, sizeof(v));
+	e->p += sizeof(v);
+}
+
+static void emit_rex(struct emitter *e, int reg, int index, int base)
+{
+	emit8(e, 0x48 | (reg >> 3) << 2 | (index >= 0 ? index >> 3 : 0) << 1 | base >> 3);
+}
+
+static void emit_op(struct emitter *e, int op)
+{
+	if (op > 0xff)
+	{
+		emit8(e, op >> 8);
+	}
+	emit8(e, op);
+}
+
+/* op reg, [base + index*8 + disp] */
+static void emit_rm(struct emitter *e, int op, int reg, int base, int index, int32_t disp)
+{
+	emit_rex(e, reg, index, base);
+	emit_op(e, op);
+	if (index >= 0)
+	{
+		emit8(e, 0x80 | (reg & 7) << 3 | 4);
+		emit8(e, 0xc0 | (index & 7) << 3 | (base & 7));
+	}
+	else if ((base & 7) == RSP)
+	{
+		emit8(e, 0x80 | (reg & 7) << 3 | 4);
+		emit8(e, 0x24);
+	}
+	else
+	{
+		emit8(e, 0x80 | (reg & 7) << 3 | (base & 7));
+	}
+	emit32(e, disp);
+}
+
+/* op rm, reg (or op reg, rm, depending on the opcode) */
+static void emit_rr(struct emitter *e, int op, int reg, int rm)
+{
+	emit_rex(e, reg, -1, rm);
+	emit_op(e, op);
+	emit8(e, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* op rm, imm32 with the opcode extension ext */
+static void emit_ri(struct emitter *e, int ext, int rm, int32_t imm)
+{
+	emit_rex(e, 0, -1, rm);
+	emit8(e, 0x81);
+	emit8(e, 0xc0 | ext << 3 | (rm & 7));
+	emit32(e, imm);
+}
+
+static int fits32(int64_t v)
+{
+	return v == (int32_t)v;
+}
+
+static void emit_mov_imm(struct emitter *e, int reg, int64_t v)
+{
+	if (fits32(v))
+	{
+		emit_rex(e, 0, -1, reg);
+		emit8(e, 0xc7);
+		emit8(e, 0xc0 | (reg & 7));
+		emit32(e, v);
+	}
+	else
+	{
+		emit_rex(e, 0, -1, reg);
+		emit8(e, 0xb8 | (reg & 7));
+		emit64(e, v);
+	}
+}
+
+static void emit_push(struct emitter *e, int reg)
+{
+	if (reg >= R8)
+	{
+		emit8(e, 0x41);
+	}
+	emit8(e, 0x50 | (reg & 7));
+}
+
+static void emit_pop(struct emitter *e, int reg)
+{
+	if (reg >= R8)
+	{
+		emit8(e, 0x41);
+	}
+	emit8(e, 0x58 | (reg & 7));
+}
+
+/* jmp/call *reg */
+static void emit_indirect(struct emitter *e, int ext, int reg)
+{
+	if (reg >= R8)
+	{
+		emit8(e, 0x41);
+	}
+	emit8(e, 0xff);
+	emit8(e, 0xc0 | ext << 3 | (reg & 7));
+}
+
+static void patch(uint8_t *rel, uint8_t *target)
+{
+	int32_t v = target - (rel + 4);
+	memcpy(rel, &v, sizeof(v));
+}
+
+static uint8_t *emit_jcc(struct emitter *e, int cc)
+{
+	emit8(e, 0x0f);
+	emit8(e, 0x80 | cc);
+	emit32(e, 0);
+	return e->p - 4;
+}
+
+static uint8_t *emit_jmp(struct emitter *e)
+{
+	emit8(e, 0xe9);
+	emit32(e, 0);
+	return e->p - 4;
+}
+
+static void emit_jmp_to(struct emitter *e, uint8_t *target)
+{
+	patch(emit_jmp(e), target);
+}
+
+static void emit_steps(struct emitter *e, unsigned retired)
+{
+	if (retired)
+	{
+		emit_rm(e, 0x81, 0, REG_M, -1, offsetof(struct module, steps));
+		emit32(e, retired);
+	}
+}
+
+/* leave the native code if cc holds, the interpreter resumes at pc */
+static void emit_side_exit(struct emitter *e, int cc, int64_t pc, unsigned retired)
+{
+	struct stub *s = e->stubs + e->nstubs++;
+	s->rel = emit_jcc(e, cc);
+	s->pc = pc;
+	s->retired = retired;
+}
+
+/* kind of the operand, as far as the native code is concerned */
+static int arg_kind(struct module *m, const struct insn *i, int k)
+{
+	int64_t arg = i->arg[k];
+	switch (i->kind[k])
+	{
+	case ARG_ABS:
+	case ARG_FAR:
+		/* NOTE: the memory doesn't shrink until the next
+		 * load, see jit_load() */
+		if ((uint64_t)arg < m->size && arg < INT32_MAX / 8)
+		{
+			return ARG_ABS;
+		}
+		return ARG_FAR;
+
+	default:
+		return i->kind[k];
+	}
+}
+
+/* rdx = address of the operand, leave if it is outside the memory */
+static void emit_index(struct emitter *e, const struct insn *i, int k, int64_t pc, unsigned retired)
+{
+	/* NOTE: the native code doesn't track the window of rbp,
+	 * the relative operands are always checked */
+	int64_t arg = i->arg[k];
+	int rel = i->kind[k] == ARG_REL || i->kind[k] == ARG_NEAR;
+	if (rel && fits32(arg))
+	{
+		emit_rm(e, 0x8d, RDX, REG_RBP, -1, arg);
+	}
+	else
+	{
+		emit_mov_imm(e, RDX, arg);
+		if (rel)
+		{
+			emit_rr(e, 0x01, REG_RBP, RDX);
+		}
+	}
+	emit_rr(e, 0x39, REG_SIZE, RDX);
+	emit_side_exit(e, CC_AE, pc, retired);
+}
+
+static void emit_load(struct emitter *e, const struct insn *i, int k, int reg, int64_t pc, unsigned retired)
+{
+	switch (arg_kind(e->m, i, k))
+	{
+	case ARG_IMM:
+		emit_mov_imm(e, reg, i->arg[k]);
+		break;
+
+	case ARG_ABS:
+		emit_rm(e, 0x8b, reg, REG_RAM, -1, i->arg[k] * 8);
+		break;
+
+	default:
+		emit_index(e, i, k, pc, retired);
+		emit_rm(e, 0x8b, reg, REG_RAM, RDX, 0);
+		break;
+	}
+}
+
+/* mark the page of the cell at disp, or at rcx + disp, as dirty */
+static void emit_dirty(struct emitter *e, int index, int64_t disp)
+{
+	if (index >= 0)
+	{
+		emit_rr(e, 0x89, index, RCX);
+		emit_rex(e, 0, -1, RCX);	/* shr rcx, PAGE_SHIFT */
+		emit8(e, 0xc1);
+		emit8(e, 0xe9);
+		emit8(e, PAGE_SHIFT);
+		emit_rex(e, 0, RCX, REG_DIRTY);	/* mov byte [rbp + rcx], 1 */
+		emit8(e, 0xc6);
+		emit8(e, 0x84);
+		emit8(e, (RCX & 7) << 3 | (REG_DIRTY & 7));
+		emit32(e, 0);
+	}
+	else
+	{
+		emit_rm(e, 0xc6, 0, REG_DIRTY, -1, disp >> PAGE_SHIFT);
+	}
+	emit8(e, 1);
+}
+
+static int jit_store(struct module *m, int64_t addr, int64_t value)
+{
+	m->ram[addr] = value;
+	m->dirty[addr >> PAGE_SHIFT] = 1;
+	module_invalidate(m, addr);
+	return m->jit->flush;
+}
+
+/* store rax into the program cell at rdx, leave if it was compiled */
+static void emit_store_code(struct emitter *e, int64_t next, unsigned retired)
+{
+	emit_rr(e, 0x89, REG_M, RDI);
+	emit_rr(e, 0x89, RDX, RSI);
+	emit_rr(e, 0x89, RAX, RDX);
+	emit_mov_imm(e, RAX, (intptr_t)jit_store);
+	emit_indirect(e, 2, RAX);
+	emit8(e, 0x85);		/* test eax, eax */
+	emit8(e, 0xc0);
+	emit_side_exit(e, CC_NE, next, retired);
+}
+
+/*
+ * store rax into the program cell at addr, the same as jit_store()
+ * without the call unless the cell was compiled
+ */
+static void emit_store_cell(struct emitter *e, int64_t addr, int64_t next, unsigned retired)
+{
+	struct jit *j = e->m->jit;
+	emit_rm(e, 0x89, RAX, REG_RAM, -1, addr * 8);
+	emit_dirty(e, -1, addr);
+	emit_rm(e, 0x8b, RCX, REG_M, -1, offsetof(struct module, code));
+	/* NOTE: the same cells as module_invalidate(), the
+	 * superinstructions cover the instruction after them */
+	for (int64_t pc = addr >= FUSE_SPAN - 1 ? addr - (FUSE_SPAN - 1) : 0; pc <= addr; pc++)
+	{
+		/* mov byte [rcx + disp], INSN_STALE */
+		emit_rm(e, 0xc6, 0, RCX, -1, pc * sizeof(struct insn) + offsetof(struct insn, op));
+		emit8(e, INSN_STALE);
+	}
+	emit_mov_imm(e, RCX, (intptr_t)(j->map + addr));
+	emit_rm(e, 0x80, 7, RCX, -1, 0);	/* cmp byte [rcx], 0 */
+	emit8(e, 0);
+	uint8_t *done = emit_jcc(e, CC_E);
+	emit_mov_imm(e, RDX, addr);
+	emit_store_code(e, next, retired);
+	patch(done, e->p);
+}
+
+/* store rax into operand k */
+static void emit_store(struct emitter *e, const struct insn *i, int k, int64_t pc, unsigned retired)
+{
+	struct module *m = e->m;
+	int64_t next = pc + op_args[i->op] + 1;
+	int64_t arg = i->arg[k];
+	if (arg_kind(m, i, k) == ARG_ABS)
+	{
+		if ((uint64_t)arg >= m->ncode)
+		{
+			emit_rm(e, 0x89, RAX, REG_RAM, -1, arg * 8);
+			emit_dirty(e, -1, arg);
+		}
+		else
+		{
+			emit_store_cell(e, arg, next, retired + 1);
+		}
+		return;
+	}
+
+	emit_index(e, i, k, pc, retired);
+	emit_ri(e, 7, RDX, m->ncode);
+	uint8_t *code = emit_jcc(e, CC_B);
+	emit_rm(e, 0x89, RAX, REG_RAM, RDX, 0);
+	emit_dirty(e, RDX, 0);
+	uint8_t *done = emit_jmp(e);
+	patch(code, e->p);
+	emit_store_code(e, next, retired + 1);
+	patch(done, e->p);
+}
+
+/* jump to the target of the instruction at pc */
+static void emit_goto(struct emitter *e, const struct insn *i, int64_t pc, unsigned retired)
+{
+	struct jit *j = e->m->jit;
+	if (i->kind[1] == ARG_IMM)
+	{
+		int64_t target = i->arg[1];
+		emit_steps(e, retired + 1);
+		if (target == e->start)
+		{
+			emit_jmp_to(e, e->entry);
+		}
+		else if ((uint64_t)target < e->m->ncode && j->entry[target])
+		{
+			emit_jmp_to(e, j->entry[target]);
+		}
+		else
+		{
+			emit_mov_imm(e, RAX, target);
+			emit_jmp_to(e, j->chain);
+		}
+	}
+	else
+	{
+		emit_load(e, i, 1, RAX, pc, retired);
+		emit_steps(e, retired + 1);
+		emit_jmp_to(e, j->chain);
+	}
+}
+
+/* the instruction at pc is the same one of the loaded program */
+static int pristine(struct module *m, int64_t pc, size_t len)
+{
+	return memcmp(m->ram + pc, m->jit->image + pc, len * sizeof(int64_t)) == 0;
+}
+
+static void jit_protect(struct jit *j, int writable)
+{
+	mprotect(j->buf, j->bsize, writable
+		 ? PROT_READ | PROT_WRITE
+		 : PROT_READ | PROT_EXEC);
+}
+
+/* discard the compiled blocks and emit the trampolines */
+static void jit_flush(struct module *m)
+{
+	struct jit *j = m->jit;
+	memset(j->entry, 0, j->isize * sizeof(j->entry[0]));
+	memset(j->hits, 0, j->isize * sizeof(j->hits[0]));
+	memset(j->map, 0, j->isize * sizeof(j->map[0]));
+	j->size = 0;
+	if (j->flush)
+	{
+		j->flushes++;
+		j->flush = 0;
+	}
+
+	jit_protect(j, 1);
+	struct emitter e = { .m = m, .p = j->buf };
+
+	/* void enter(struct module *m, void *code) */
+	j->enter = (void (*)(struct module *, void *))e.p;
+	emit_push(&e, RBX);
+	emit_push(&e, RBP);
+	emit_push(&e, R12);
+	emit_push(&e, R13);
+	emit_push(&e, R14);
+	emit_push(&e, R15);
+	emit_ri(&e, 5, RSP, 8);	/* keep the stack aligned for the calls */
+	emit_rr(&e, 0x89, RDI, REG_M);
+	emit_rm(&e, 0x8b, REG_RAM, REG_M, -1, offsetof(struct module, ram));
+	emit_rm(&e, 0x8b, REG_SIZE, REG_M, -1, offsetof(struct module, size));
+	emit_rm(&e, 0x8b, REG_RBP, REG_M, -1, offsetof(struct module, rbp));
+	emit_rm(&e, 0x8b, REG_DIRTY, REG_M, -1, offsetof(struct module, dirty));
+	emit_rm(&e, 0x8b, REG_ENTRY, REG_M, -1, offsetof(struct module, jit));
+	emit_rm(&e, 0x8b, REG_ENTRY, REG_ENTRY, -1, offsetof(struct jit, entry));
+	emit_indirect(&e, 4, RSI);
+
+	/* exit with the next pc in rax */
+	j->exit = e.p;
+	emit_rm(&e, 0x89, RAX, REG_M, -1, offsetof(struct module, pc));
+	emit_rm(&e, 0x89, REG_RBP, REG_M, -1, offsetof(struct module, rbp));
+	emit_ri(&e, 0, RSP, 8);
+	emit_pop(&e, R15);
+	emit_pop(&e, R14);
+	emit_pop(&e, R13);
+	emit_pop(&e, R12);
+	emit_pop(&e, RBP);
+	emit_pop(&e, RBX);
+	emit8(&e, 0xc3);
+
+	/* continue with the block at rax if it was compiled */
+	j->chain = e.p;
+	emit_ri(&e, 7, RAX, m->ncode);
+	patch(emit_jcc(&e, CC_AE), j->exit);
+	emit_rm(&e, 0x8b, RCX, REG_ENTRY, RAX, 0);
+	emit_rr(&e, 0x85, RCX, RCX);
+	patch(emit_jcc(&e, CC_E), j->exit);
+	emit_indirect(&e, 4, RCX);
+
+	j->used = e.p - j->buf;
+	jit_protect(j, 0);
+}
+
+void jit_free(struct jit *j)
+{
+	if (j)
+	{
+		munmap(j->buf, j->bsize);
+		free(j->image);
+		free(j->entry);
+		free(j->hits);
+		free(j->map);
+		free(j);
+	}
+}
+
+void jit_load(struct module *m, const int64_t *prog, size_t psize)
+{
+	struct jit *j = m->jit;
+	if (!j)
+	{
+		j = calloc(1, sizeof(*j));
+		if (!j)
+		{
+			return;
+		}
+		j->bsize = JIT_BUFFER_SIZE;
+		j->buf = mmap(NULL, j->bsize, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (j->buf == MAP_FAILED)
+		{
+			free(j);
+			return;
+		}
+		m->jit = j;
+	}
+	else if (j->isize == psize && m->size >= j->size &&
+		 memcmp(j->image, prog, psize * sizeof(*prog)) == 0)
+	{
+		/* NOTE: the blocks are compiled only from the
+		 * unmodified program, they are valid again unless
+		 * the absolute operands they don't check are now
+		 * outside the memory (a module loaded from an
+		 * image starts with its smaller memory) */
+		j->flush = 0;
+		return;
+	}
+
+	int64_t *image = realloc(j->image, psize * sizeof(*image));
+	void **entry = realloc(j->entry, psize * sizeof(*entry));
+	uint16_t *hits = realloc(j->hits, psize * sizeof(*hits));
+	uint8_t *map = realloc(j->map, psize * sizeof(*map));
+	if (image) j->image = image;
+	if (entry) j->entry = entry;
+	if (hits) j->hits = hits;
+	if (map) j->map = map;
+	if (!image || !entry || !hits || !map)
+	{
+		jit_free(j);
+		m->jit = NULL;
+		return;
+	}
+	memcpy(j->image, prog, psize * sizeof(*prog));
+	j->isize = psize;
+	j->flush = 0;
+	j->flushes = 0;
+	jit_flush(m);
+}
+
+int jit_compile(struct module *m, int64_t start)
+{
+	struct jit *j = m->jit;
+	if (j->flush || j->flushes >= JIT_MAX_FLUSHES)
+	{
+		j->hits[start] = JIT_NEVER;
+		return 0;
+	}
+	if (j->bsize - j->used < (JIT_MAX_INSNS + 1) * JIT_INSN_BYTES)
+	{
+		jit_flush(m);
+	}
+	if (m->size > j->size)
+	{
+		j->size = m->size;
+	}
+
+	jit_protect(j, 1);
+	struct emitter *e = malloc(sizeof(*e));
+	if (!e)
+	{
+		jit_protect(j, 0);
+		return 0;
+	}
+	e->m = m;
+	e->p = e->entry = j->buf + j->used;
+	e->start = start;
+	e->nstubs = 0;
+
+	int64_t pc = start;
+	unsigned retired = 0;
+	int open = 1;
+	while (open && retired < JIT_MAX_INSNS && (uint64_t)pc < m->ncode)
+	{
+		struct insn *i = m->code + pc, first;
+		if (i->op == INSN_STALE)
+		{
+			module_decode(m, pc, i);
+		}
+		else if (i->op != insn_unfused(i->op))
+		{
+			/* NOTE: the second instruction of a
+			 * superinstruction is compiled on its own */
+			first = *i;
+			first.op = insn_unfused(i->op);
+			i = &first;
+		}
+
+		/* NOTE: input, output and halt are left to the
+		 * interpreter */
+		if (i->op == INSN_FAULT || i->op == OP_IN ||
+		    i->op == OP_OUT || i->op == OP_HALT)
+		{
+			break;
+		}
+
+		size_t len = op_args[i->op] + 1;
+		if (pc + len > m->ncode || !pristine(m, pc, len))
+		{
+			break;
+		}
+
+		switch (i->op)
+		{
+		case OP_ADD:
+		case OP_MUL:
+		case OP_TLT:
+		case OP_TEQ:
+			emit_load(e, i, 0, RAX, pc, retired);
+			emit_load(e, i, 1, RCX, pc, retired);
+			if (i->op == OP_ADD)
+			{
+				emit_rr(e, 0x01, RCX, RAX);
+			}
+			else if (i->op == OP_MUL)
+			{
+				emit_rr(e, 0x0faf, RAX, RCX);
+			}
+			else
+			{
+				emit_rr(e, 0x39, RCX, RAX);
+				emit8(e, 0x0f);	/* setl/sete al */
+				emit8(e, 0x90 | (i->op == OP_TLT ? CC_L : CC_E));
+				emit8(e, 0xc0);
+				emit8(e, 0x0f);	/* movzx eax, al */
+				emit8(e, 0xb6);
+				emit8(e, 0xc0);
+			}
+			emit_store(e, i, 2, pc, retired);
+			break;
+
+		case OP_ARB:
+			if (i->kind[0] == ARG_IMM && fits32(i->arg[0]))
+			{
+				emit_ri(e, 0, REG_RBP, i->arg[0]);
+			}
+			else
+			{
+				emit_load(e, i, 0, RAX, pc, retired);
+				emit_rr(e, 0x01, RAX, REG_RBP);
+			}
+			break;
+
+		case OP_JNZ:
+		case OP_JZ:
+			if (i->kind[0] == ARG_IMM)
+			{
+				if ((i->arg[0] != 0) == (i->op == OP_JNZ))
+				{
+					emit_goto(e, i, pc, retired);
+					open = 0;
+				}
+			}
+			else
+			{
+				emit_load(e, i, 0, RAX, pc, retired);
+				emit_rr(e, 0x85, RAX, RAX);
+				uint8_t *skip = emit_jcc(e, i->op == OP_JNZ ? CC_E : CC_NE);
+				emit_goto(e, i, pc, retired);
+				patch(skip, e->p);
+			}
+			break;
+		}
+		pc += len;
+		retired++;
+	}
+
+	if (retired == 0)
+	{
+		free(e);
+		jit_protect(j, 0);
+		j->hits[start] = JIT_NEVER;
+		return 0;
+	}
+
+	if (open)
+	{
+		emit_steps(e, retired);
+		emit_mov_imm(e, RAX, pc);
+		emit_jmp_to(e, j->chain);
+	}
+
+	for (size_t k = 0; k < e->nstubs; k++)
+	{
+		struct stub *s = e->stubs + k;
+		patch(s->rel, e->p);
+		emit_steps(e, s->retired);
+		emit_mov_imm(e, RAX, s->pc);
+		emit_jmp_to(e, j->exit);
+	}
+
+	j->used = e->p - j->buf;
+	j->entry[start] = e->entry;
+	memset(j->map + start, 1, pc - start);
+	free(e);
+	jit_protect(j, 0);
+	return 1;
+}
+
+void jit_run(struct module *m)
+{
+	struct jit *j = m->jit;
+	int64_t pc;
+	if (j->flush)
+	{
+		jit_flush(m);
+		return;
+	}
+	do
+	{
+		/*
+		 * a block that leaves to a target without native code
+		 * counts as a taken jump; the loop stops when the same
+		 * instruction exits again, it needs the interpreter
+		 */
+		pc = m->pc;
+		j->enter(m, j->entry[pc]);
+	} while (!j->flush && m->pc != pc && jit_ready(m, m->pc));
+	if (j->flush)
+	{
+		jit_flush(m);
+	}
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef JIT_H
+#define JIT_H
+
+/*
+ * Native backend of the interpreter: the targets of the taken jumps
+ * that become hot are compiled to x86-64 code. The compiled blocks
+ * run until they reach an instruction that only the interpreter can
+ * execute (input, output, halt, a memory access that needs to grow
+ * the memory or a write into compiled code), then they store pc and
+ * rbp back into the module and return.
+ */
+
+#include <stdint.h>
+
+#include "module.h"
+
+#ifdef INTCODE_JIT
+
+/* taken jumps to an address before it is compiled */
+#define JIT_THRESHOLD 16
+
+/* the address cannot start a block */
+#define JIT_NEVER UINT16_MAX
+
+struct jit
+{
+	uint8_t *buf;		/* executable buffer */
+	size_t bsize;
+	size_t used;
+
+	/* trampolines at the start of the buffer */
+	void (*enter)(struct module *m, void *code);
+	uint8_t *exit;
+	uint8_t *chain;
+
+	int64_t *image;		/* program the blocks are compiled from */
+	size_t isize;
+	size_t size;		/* cells of the memory they assume */
+
+	void **entry;		/* native code of each address */
+	uint16_t *hits;		/* taken jumps to each address */
+	uint8_t *map;		/* cells covered by native code */
+
+	int flush;		/* the native code must be discarded */
+	unsigned flushes;	/* flushes caused by self-modifying code */
+};
+
+void jit_free(struct jit *j);
+
+/* keep the compiled blocks when the same program is loaded again in
+ * a memory at least as large */
+void jit_load(struct module *m, const int64_t *prog, size_t psize);
+
+/* compile the block at pc, returns 0 if that is not possible */
+int jit_compile(struct module *m, int64_t pc);
+
+/* run the native code at m->pc until it needs the interpreter */
+void jit_run(struct module *m);
+
+/* count a taken jump to pc, returns 1 if native code is available */
+static inline int jit_ready(struct module *m, int64_t pc)
+{
+	struct jit *j = m->jit;
+	if ((uint64_t)pc >= m->ncode)
+	{
+		return 0;
+	}
+	else if (j->entry[pc])
+	{
+		return 1;
+	}
+	else if (j->hits[pc] == JIT_NEVER || ++j->hits[pc] < JIT_THRESHOLD)
+	{
+		return 0;
+	}
+	return jit_compile(m, pc);
+}
+
+#endif
+
+#endif
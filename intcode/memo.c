@@ -0,0 +1,381 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intcode.h"
+#include "module.h"
+#include "memo.h"
+
+static uint64_t memo_hash(const struct memo_shape *s, const int64_t *values)
+{
+	uint64_t h = (uintptr_t)s;
+	for (size_t k = 0; k < s->nreads; k++)
+	{
+		h = (h ^ (uint64_t)values[k]) * UINT64_C(0x9e3779b97f4a7c15);
+	}
+	return h ^ h >> 29;
+}
+
+static void memo_clear(struct memo *mo)
+{
+	for (size_t b = 0; b < mo->nbuckets; b++)
+	{
+		struct memo_entry *e = mo->bucket[b];
+		while (e)
+		{
+			struct memo_entry *next = e->next;
+			free(e);
+			e = next;
+		}
+	}
+	free(mo->bucket);
+	mo->bucket = NULL;
+	mo->nbuckets = 0;
+	mo->nentries = 0;
+
+	for (size_t pc = 0; pc < mo->isize; pc++)
+	{
+		struct memo_shape *s = mo->func[pc].shapes;
+		while (s)
+		{
+			struct memo_shape *next = s->next;
+			free(s);
+			s = next;
+		}
+	}
+	if (mo->isize)
+	{
+		memset(mo->func, 0, mo->isize * sizeof(*mo->func));
+		memset(mo->map, 0, mo->isize);
+	}
+}
+
+void memo_free(struct memo *mo)
+{
+	if (mo)
+	{
+		memo_clear(mo);
+		free(mo->func);
+		free(mo->map);
+		free(mo);
+	}
+}
+
+void memo_load(struct module *m, size_t psize)
+{
+	struct memo *mo = m->memo;
+	mo->depth = mo->live = 0;
+	mo->flush = 0;
+	/* NOTE: cleared even for the same program, the calls cached
+	 * before may have run code the program patched after loading */
+	memo_clear(mo);
+	if (mo->isize == psize)
+	{
+		return;
+	}
+
+	size_t n = psize ? psize : 1;
+	struct memo_func *func = realloc(mo->func, n * sizeof(*func));
+	if (func) mo->func = func;
+	uint8_t *map = realloc(mo->map, n);
+	if (map) mo->map = map;
+	if (!func || !map)
+	{
+		fprintf(stderr, "Cannot allocate the call cache\n");
+		abort();
+	}
+	memset(func, 0, psize * sizeof(*func));
+	memset(map, 0, psize);
+	mo->isize = psize;
+}
+
+/* forget every cached call, the code they ran changed */
+static void memo_flush(struct memo *mo)
+{
+	memo_clear(mo);
+	mo->flush = 0;
+	for (size_t d = 0; d < mo->depth; d++)
+	{
+		mo->rec[d].failed = 1;
+	}
+	mo->live = 0;
+}
+
+static struct memo_entry *memo_find(struct module *m, const struct memo_shape *s,
+				    int64_t *values)
+{
+	struct memo *mo = m->memo;
+	if (!mo->nbuckets)
+	{
+		return NULL;
+	}
+	for (size_t k = 0; k < s->nreads; k++)
+	{
+		values[k] = module_peek(m, m->rbp + s->off[k]);
+	}
+	uint64_t hash = memo_hash(s, values);
+	struct memo_entry *e = mo->bucket[hash & (mo->nbuckets - 1)];
+	while (e && (e->shape != s || e->hash != hash ||
+		     memcmp(e->data, values, s->nreads * sizeof(*values))))
+	{
+		e = e->next;
+	}
+	return e;
+}
+
+int memo_call(struct module *m, int64_t ret, uint64_t *steps)
+{
+	struct memo *mo = m->memo;
+	if (mo->flush)
+	{
+		memo_flush(mo);
+	}
+	if ((uint64_t)m->pc >= mo->isize)
+	{
+		return 0;
+	}
+
+	struct memo_func *f = mo->func + m->pc;
+	int64_t values[MEMO_MAX_CELLS];
+	for (const struct memo_shape *s = f->shapes; s; s = s->next)
+	{
+		struct memo_entry *e = memo_find(m, s, values);
+		if (!e)
+		{
+			continue;
+		}
+
+		/* NOTE: the calls being recorded see the reads and
+		 * the writes of the cached one */
+		f->hits++;
+		int64_t rbp = m->rbp;
+		for (size_t k = 0; k < s->nreads; k++)
+		{
+			memo_read(m, rbp + s->off[k], e->data[k]);
+		}
+		/* NOTE: a write into the recorded code only
+		 * marks the cache to be flushed */
+		const int64_t *w = e->data + s->nreads;
+		for (size_t k = 0; k < e->nwrites; k++, w += 2)
+		{
+			memo_write(m, rbp + w[0], w[1]);
+			module_poke(m, rbp + w[0], w[1]);
+		}
+		*steps += e->steps;
+		m->pc = ret;
+		return 1;
+	}
+
+	if (mo->depth < MEMO_MAX_DEPTH && (f->hits || f->fails < MEMO_MAX_FAILS))
+	{
+		struct memo_rec *r = mo->rec + mo->depth++;
+		r->ret = ret;
+		r->rbp = m->rbp;
+		r->steps = *steps;
+		r->func = f;
+		r->failed = 0;
+		r->nreads = r->nwrites = 0;
+		mo->live++;
+	}
+	return 0;
+}
+
+static void memo_reject(struct memo *mo, struct memo_rec *r)
+{
+	if (!r->failed)
+	{
+		r->failed = 1;
+		r->func->fails++;
+		mo->live--;
+	}
+}
+
+void memo_fail(struct module *m)
+{
+	struct memo *mo = m->memo;
+	for (size_t d = 0; d < mo->depth; d++)
+	{
+		memo_reject(mo, mo->rec + d);
+	}
+}
+
+static struct memo_cell *memo_cell(struct memo_cell *cells, size_t n, int64_t off)
+{
+	for (size_t k = 0; k < n; k++)
+	{
+		if (cells[k].off == off)
+		{
+			return cells + k;
+		}
+	}
+	return NULL;
+}
+
+void memo_track_read(struct module *m, int64_t addr, int64_t value)
+{
+	struct memo *mo = m->memo;
+	for (size_t d = 0; d < mo->depth; d++)
+	{
+		struct memo_rec *r = mo->rec + d;
+		int64_t off = addr - r->rbp;
+		if (r->failed || memo_cell(r->write, r->nwrites, off) ||
+		    memo_cell(r->read, r->nreads, off))
+		{
+			continue;
+		}
+		if (r->nreads == MEMO_MAX_CELLS)
+		{
+			memo_reject(mo, r);
+			continue;
+		}
+		r->read[r->nreads++] = (struct memo_cell){ off, value };
+	}
+}
+
+void memo_track_write(struct module *m, int64_t addr, int64_t value)
+{
+	struct memo *mo = m->memo;
+	for (size_t d = 0; d < mo->depth; d++)
+	{
+		struct memo_rec *r = mo->rec + d;
+		int64_t off = addr - r->rbp;
+		if (r->failed)
+		{
+			continue;
+		}
+		struct memo_cell *c = memo_cell(r->write, r->nwrites, off);
+		if (c)
+		{
+			c->value = value;
+		}
+		else if (r->nwrites == MEMO_MAX_CELLS)
+		{
+			memo_reject(mo, r);
+		}
+		else
+		{
+			r->write[r->nwrites++] = (struct memo_cell){ off, value };
+		}
+	}
+}
+
+static void memo_rehash(struct memo *mo)
+{
+	size_t n = mo->nbuckets ? mo->nbuckets * 2 : 1024;
+	struct memo_entry **bucket = calloc(n, sizeof(*bucket));
+	if (!bucket)
+	{
+		return;
+	}
+	for (size_t b = 0; b < mo->nbuckets; b++)
+	{
+		struct memo_entry *e = mo->bucket[b];
+		while (e)
+		{
+			struct memo_entry *next = e->next;
+			e->next = bucket[e->hash & (n - 1)];
+			bucket[e->hash & (n - 1)] = e;
+			e = next;
+		}
+	}
+	free(mo->bucket);
+	mo->bucket = bucket;
+	mo->nbuckets = n;
+}
+
+/* the shape of the function with the offsets read by r */
+static struct memo_shape *memo_shape(struct memo_func *f, const struct memo_rec *r)
+{
+	for (struct memo_shape *s = f->shapes; s; s = s->next)
+	{
+		size_t k = 0;
+		while (k < r->nreads && s->off[k] == r->read[k].off)
+		{
+			k++;
+		}
+		if (k == r->nreads && k == s->nreads)
+		{
+			return s;
+		}
+	}
+	if (f->nshapes == MEMO_MAX_SHAPES)
+	{
+		return NULL;
+	}
+
+	struct memo_shape *s = malloc(sizeof(*s));
+	if (!s)
+	{
+		return NULL;
+	}
+	s->nreads = r->nreads;
+	for (size_t k = 0; k < r->nreads; k++)
+	{
+		s->off[k] = r->read[k].off;
+	}
+	s->next = f->shapes;
+	f->shapes = s;
+	f->nshapes++;
+	return s;
+}
+
+void memo_return(struct module *m, uint64_t steps)
+{
+	struct memo *mo = m->memo;
+	if (mo->flush)
+	{
+		memo_flush(mo);
+	}
+	struct memo_rec *r = mo->rec + --mo->depth;
+	if (r->failed)
+	{
+		return;
+	}
+	mo->live--;
+	if (mo->nentries == MEMO_MAX_ENTRIES)
+	{
+		return;
+	}
+
+	struct memo_shape *s = memo_shape(r->func, r);
+	if (!s)
+	{
+		return;
+	}
+	if (mo->nentries * 2 >= mo->nbuckets)
+	{
+		memo_rehash(mo);
+	}
+	struct memo_entry *e = malloc(sizeof(*e) + (s->nreads + 2 * r->nwrites) *
+				      sizeof(e->data[0]));
+	if (!e || !mo->nbuckets)
+	{
+		free(e);
+		return;
+	}
+	for (size_t k = 0; k < r->nreads; k++)
+	{
+		e->data[k] = r->read[k].value;
+	}
+	int64_t *w = e->data + s->nreads;
+	for (size_t k = 0; k < r->nwrites; k++)
+	{
+		*w++ = r->write[k].off;
+		*w++ = r->write[k].value;
+	}
+	e->shape = s;
+	e->hash = memo_hash(s, e->data);
+	e->steps = steps - r->steps;
+	e->nwrites = r->nwrites;
+	e->next = mo->bucket[e->hash & (mo->nbuckets - 1)];
+	mo->bucket[e->hash & (mo->nbuckets - 1)] = e;
+	mo->nentries++;
+}
+
+void memo_stop(struct module *m)
+{
+	struct memo *mo = m->memo;
+	memo_fail(m);
+	mo->depth = 0;
+}
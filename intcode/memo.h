@@ -0,0 +1,175 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+/*
+ * Cache of the subroutine calls, see module_memoize(). A taken jump
+ * to a constant address is a call when [rbp] holds the address after
+ * the jump, and the call returns when pc gets there again with the
+ * same rbp. While a call runs, the cells it reads before writing them
+ * and the final values of the cells it writes are recorded relative
+ * to rbp. A call that uses an absolute operand, does I/O or touches
+ * too many cells is not cached. The execution depends only on the
+ * cells that were read, so the next call of the subroutine that finds
+ * the same values there is answered by copying the writes.
+ */
+
+#include <stdint.h>
+
+#include "module.h"
+
+/* cells read or written by a cached call */
+#define MEMO_MAX_CELLS	32
+
+/* calls recorded at the same time */
+#define MEMO_MAX_DEPTH	64
+
+/* sets of cells read by the calls of a subroutine */
+#define MEMO_MAX_SHAPES	8
+
+/* a subroutine is not recorded any more after this many failures
+ * without any success */
+#define MEMO_MAX_FAILS	64
+
+/* total number of cached calls */
+#define MEMO_MAX_ENTRIES (1 << 16)
+
+struct memo_cell
+{
+	int64_t off;		/* address - rbp */
+	int64_t value;
+};
+
+/* the offsets read by some calls of a subroutine */
+struct memo_shape
+{
+	struct memo_shape *next;
+	size_t nreads;
+	int64_t off[MEMO_MAX_CELLS];
+};
+
+struct memo_entry
+{
+	struct memo_entry *next;	/* same bucket */
+	const struct memo_shape *shape;
+	uint64_t hash;
+	uint64_t steps;		/* instructions retired by the call */
+	size_t nwrites;
+	int64_t data[];		/* the values read, then the writes */
+};
+
+struct memo_func
+{
+	struct memo_shape *shapes;
+	size_t nshapes;
+	unsigned fails;
+	unsigned hits;
+};
+
+/* call being recorded */
+struct memo_rec
+{
+	int64_t ret;		/* return address */
+	int64_t rbp;
+	uint64_t steps;		/* retired before the call */
+	struct memo_func *func;
+	int failed;
+	size_t nreads;
+	size_t nwrites;
+	struct memo_cell read[MEMO_MAX_CELLS];
+	struct memo_cell write[MEMO_MAX_CELLS];
+};
+
+struct memo
+{
+	size_t isize;		/* cells of the program */
+	struct memo_func *func;	/* subroutine at each address */
+	uint8_t *map;		/* cells of the recorded code */
+
+	struct memo_entry **bucket;
+	size_t nbuckets;	/* power of two */
+	size_t nentries;
+
+	int flush;		/* the recorded code was written */
+
+	struct memo_rec rec[MEMO_MAX_DEPTH];
+	size_t depth;
+	size_t live;		/* records that did not fail */
+};
+
+void memo_free(struct memo *mo);
+
+/* empty the cache for a program of psize cells */
+void memo_load(struct module *m, size_t psize);
+
+/*
+ * the jump to m->pc is a call that returns to ret: answer it from the
+ * cache (pc and memory are updated and the steps of the call added)
+ * and return 1, or start recording it and return 0
+ */
+int memo_call(struct module *m, int64_t ret, uint64_t *steps);
+
+/* the call on top returned */
+void memo_return(struct module *m, uint64_t steps);
+
+/* slow paths of the inline hooks */
+void memo_track_read(struct module *m, int64_t addr, int64_t value);
+void memo_track_write(struct module *m, int64_t addr, int64_t value);
+void memo_fail(struct module *m);
+
+/* the execution stops, drop the calls being recorded */
+void memo_stop(struct module *m);
+
+static inline void memo_read(struct module *m, int64_t addr, int64_t value)
+{
+	if (m->memo->live)
+	{
+		memo_track_read(m, addr, value);
+	}
+}
+
+static inline void memo_write(struct module *m, int64_t addr, int64_t value)
+{
+	if (m->memo->live)
+	{
+		memo_track_write(m, addr, value);
+	}
+}
+
+/* an access that does not depend on rbp, or I/O */
+static inline void memo_global(struct module *m)
+{
+	if (m->memo->live)
+	{
+		memo_fail(m);
+	}
+}
+
+/* the instruction at pc of len cells runs */
+static inline void memo_code(struct module *m, int64_t pc, int len)
+{
+	struct memo *mo = m->memo;
+	if (!mo->depth)
+	{
+		return;
+	}
+	if ((uint64_t)pc + len > mo->isize)
+	{
+		/* NOTE: the writes into the code outside of the
+		 * program are not tracked */
+		memo_global(m);
+		return;
+	}
+	for (int k = 0; k < len; k++)
+	{
+		mo->map[pc + k] = 1;
+	}
+}
+
+static inline int memo_returned(struct module *m)
+{
+	struct memo *mo = m->memo;
+	return mo->depth && m->pc == mo->rec[mo->depth - 1].ret &&
+		m->rbp == mo->rec[mo->depth - 1].rbp;
+}
+
+#endif
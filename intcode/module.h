@@ -0,0 +1,300 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+/*
+ * Internal layout of the Intcode virtual machine, shared by the
+ * translation units of the library; the users of the library only
+ * see intcode.h.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "intcode.h"
+
+/* the native backend is available only on x86-64 */
+#if defined(INTCODE_JIT) && !(defined(__x86_64__) && defined(__unix__))
+#undef INTCODE_JIT
+#endif
+
+enum
+{
+	/* pseudo opcodes of the decoded instructions */
+	INSN_STALE = 0,		/* must be decoded again */
+	INSN_FAULT = 255,	/* invalid opcode or addressing mode */
+
+	/* superinstructions, see module_fuse() */
+	INSN_TLT_JNZ = 100,	/* compare, then branch on the result */
+	INSN_TLT_JZ,
+	INSN_TEQ_JNZ,
+	INSN_TEQ_JZ,
+	INSN_ARB_JMP,		/* move rbp, then jump (call and return) */
+
+	/* kind of the decoded operands */
+	ARG_IMM = 0,		/* literal value */
+	ARG_ABS,		/* absolute index inside the memory */
+	ARG_FAR,		/* absolute index, the memory might grow */
+	ARG_REL,		/* relative index (to rbp) */
+	ARG_NEAR,		/* relative index inside the window */
+};
+
+/* widest range of relative offsets that is verified */
+#define NEAR_SPAN	PAGE_CELLS
+
+/* the window is not verified any more after rbp left it this often */
+#define NEAR_MAX_MISSES	8
+
+struct insn
+{
+	uint8_t op;
+	uint8_t kind[3];
+	int64_t arg[3];
+};
+
+/* the memory is tracked in pages of 4 KiB */
+#define PAGE_SHIFT	9
+#define PAGE_CELLS	(1 << PAGE_SHIFT)
+
+struct page
+{
+	unsigned refs;		/* snapshots sharing the page */
+	int64_t cell[PAGE_CELLS];
+};
+
+/* the dense memory stops growing at this size */
+#define DENSE_CELLS	(1 << 16)
+
+/*
+ * The cells above the dense memory are kept in pages allocated on the
+ * first write: a hash table on the high bits of the address (the
+ * address space is too large for a flat directory) points to tables
+ * of TABLE_PAGES pages each. The pages can be shared with the
+ * snapshots and they are copied before being written.
+ */
+#define TABLE_SHIFT	9
+#define TABLE_PAGES	(1 << TABLE_SHIFT)
+
+struct table
+{
+	uint64_t key;		/* addr >> (PAGE_SHIFT + TABLE_SHIFT) */
+	struct page *page[TABLE_PAGES];
+};
+
+struct sparse
+{
+	struct table **slot;	/* open addressing, NULL if empty */
+	size_t cap;		/* power of two */
+	size_t count;
+	struct table *last;	/* last table that was looked up */
+};
+
+/* page of the sparse memory saved in a snapshot */
+struct farpage
+{
+	uint64_t index;		/* addr >> PAGE_SHIFT */
+	struct page *page;
+};
+
+/* growable ring buffer, the capacity is a power of two */
+struct queue
+{
+	int64_t *buf;
+	size_t cap;
+	size_t r, w;		/* free running indices */
+};
+
+/* values going from a module to another, see module_connect() */
+struct channel
+{
+	struct queue q;
+	channel_wake_fn wake;	/* a value arrived while it was empty */
+	void *wake_ctx;
+};
+
+struct snapshot
+{
+	unsigned refs;		/* the owner and the modules based on it */
+	struct page **pages;	/* NULL for the pages of zeros */
+	size_t npages;
+	size_t ncode;
+	int64_t near_lo, near_hi;
+	struct farpage *far;	/* pages of the sparse memory */
+	size_t nfar;
+
+	int64_t pc;
+	int64_t rbp;
+
+	struct queue in;
+	struct queue out;
+	unsigned idle_reads;
+
+	uint64_t steps;
+};
+
+struct jit;
+struct native;
+struct profile;
+struct memo;
+
+/*
+ * Program loaded once for many modules, see module_load_image(): the
+ * memory and the decoded instructions it leaves are kept in a file
+ * that the modules map copy-on-write, or copied where the file cannot
+ * be shared.
+ */
+struct image
+{
+	unsigned refs;		/* the owner and the modules mapping it */
+	int64_t *prog;
+	size_t psize;
+
+	size_t size;		/* cells of the memory */
+	size_t ncode;
+	int64_t near_lo, near_hi;
+	int near;
+
+	int fd;			/* memory, then code; -1 if not shared */
+	size_t code_offset;	/* of the code in the file */
+	int64_t *ram;		/* copies when the file is not shared */
+	struct insn *code;
+};
+
+struct module
+{
+	int64_t *ram;		/* dense memory from address 0 */
+	size_t size;
+	struct sparse far;	/* memory above DENSE_CELLS */
+	uint8_t *dirty;		/* pages written since the base snapshot */
+	uint8_t *written;	/* pages written since the last load, see
+				 * module_clean() */
+	struct snapshot *base;	/* last snapshot taken or restored */
+	int64_t pc;		/* instruction/program counter */
+	int64_t rbp;		/* relative base pointer */
+
+	struct insn *code;	/* decoded instruction at each address */
+	size_t ncode;		/* number of decoded addresses */
+	size_t csize;		/* capacity of the code array */
+	struct image *image;	/* ram and code came from it */
+	int image_ram;		/* ram is still mapped from it */
+
+	/*
+	 * Window of the relative offsets used by the program, found
+	 * when it is loaded: while rbp + [near_lo, near_hi] is inside
+	 * the memory the relative operands in that range are decoded
+	 * as ARG_NEAR and they are accessed without checks.
+	 */
+	int64_t near_lo, near_hi;
+	int near;		/* the window is inside the memory */
+	unsigned near_misses;	/* times rbp moved the window out */
+
+	struct queue in;
+	struct queue out;
+
+	module_input_fn input;	/* I/O callbacks, see module_io() */
+	module_output_fn output;
+	void *io_ctx;
+
+	struct channel *cin;	/* read after the input queue */
+	struct channel *cout;	/* replaces the output queue */
+
+	int64_t idle_value;	/* read from the empty input queue */
+	unsigned idle_limit;
+	unsigned idle_reads;	/* idle values read since the last I/O */
+
+	FILE *echo;		/* echoes the input and output */
+
+	uint64_t steps;		/* retired instructions */
+
+	struct jit *jit;	/* native code, NULL if not compiled */
+	struct native *native;	/* program translated by icc, or NULL */
+	struct profile *profile; /* counts of INTCODE_PROFILE builds */
+	struct memo *memo;	/* cached calls, see module_memoize() */
+};
+
+/* number of operands of each opcode */
+static const uint8_t op_args[100] = {
+	[OP_ADD] = 3,
+	[OP_MUL] = 3,
+	[OP_IN] = 1,
+	[OP_OUT] = 1,
+	[OP_JNZ] = 2,
+	[OP_JZ] = 2,
+	[OP_TLT] = 3,
+	[OP_TEQ] = 3,
+	[OP_ARB] = 1,
+};
+
+/* bitmask of the operands that are written by each opcode */
+static const uint8_t op_dest[100] = {
+	[OP_ADD] = 4,
+	[OP_MUL] = 4,
+	[OP_IN] = 1,
+	[OP_TLT] = 4,
+	[OP_TEQ] = 4,
+};
+
+/*
+ * decode the instruction in cell[0..3], the absolute operands below
+ * size are known to be inside the memory
+ */
+void insn_decode(struct insn *i, const int64_t *cell, size_t size);
+
+/* decode the instruction at pc, the memory must cover pc+3 */
+void module_decode(struct module *m, int64_t pc, struct insn *i);
+
+/* cells covered by the longest superinstruction */
+#define FUSE_SPAN	7
+
+/*
+ * turn the decoded instruction at pc into a superinstruction if the
+ * next one completes a frequent pair; the fused handler finds the
+ * second instruction at i[len], the write into any of their cells
+ * makes the first one stale again
+ */
+void module_fuse(struct module *m, int64_t pc, struct insn *i);
+
+/* first instruction of a superinstruction */
+static inline int insn_unfused(int op)
+{
+	switch (op)
+	{
+	case INSN_TLT_JNZ:
+	case INSN_TLT_JZ: return OP_TLT;
+	case INSN_TEQ_JNZ:
+	case INSN_TEQ_JZ: return OP_TEQ;
+	case INSN_ARB_JMP: return OP_ARB;
+	default:          return op;
+	}
+}
+
+/* rbp changed, check that the window is still inside the memory */
+void module_rebase(struct module *m);
+
+static inline void module_check_window(struct module *m)
+{
+	int64_t lo = m->rbp + m->near_lo;
+	int64_t hi = m->rbp + m->near_hi;
+	if (m->near ? lo < 0 || hi >= (int64_t)m->size
+	    : lo >= 0 && hi < DENSE_CELLS && m->near_misses < NEAR_MAX_MISSES)
+	{
+		module_rebase(m);
+	}
+}
+
+/* a program cell was written, drop what was derived from it */
+void module_invalidate(struct module *m, int64_t addr);
+
+/* the memory and the code are ready, reset the rest of the module */
+void module_start(struct module *m, const int64_t *prog, size_t psize);
+
+/* set ram, size, code and ncode of the module from the image */
+void image_map(struct module *m, struct image *img);
+
+/* the memory is about to grow, take a private copy of it */
+void image_copy_ram(struct module *m);
+
+/* the module stops using its image, memory and code are released */
+void image_unmap(struct module *m);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+/*
+ * Programs translated ahead of time to C by icc. The generated file
+ * registers itself when it is linked: module_load() attaches it to
+ * the modules that load the same program and module_execute() runs
+ * it in place of the interpreter. The instructions that the
+ * translator could not reach, the dynamic jumps to them and the
+ * programs that write into their compiled code go back to the
+ * interpreter, which enters the native code again at the next taken
+ * jump to a compiled address.
+ */
+
+#include <stdint.h>
+
+#include "module.h"
+
+/* the interpreter must continue at m->pc */
+#define NATIVE_EXIT	-3
+
+struct native
+{
+	const char *name;
+	const int64_t *image;	/* program the code was translated from */
+	size_t isize;
+	const uint8_t *entry;	/* addresses with a compiled instruction */
+	const uint8_t *map;	/* cells covered by compiled instructions */
+
+	/* run from m->pc, returns a state of the execution or
+	 * NATIVE_EXIT */
+	int (*run)(struct module *m);
+
+	struct native *next;
+};
+
+/* make the translated program available to module_load() */
+void native_register(struct native *n);
+
+/* slow paths of the generated code, the same as the interpreter */
+int64_t native_load(struct module *m, int64_t addr);
+void native_store(struct module *m, int64_t addr, int64_t value);
+
+/* returns -1 if the input is available, the state otherwise */
+int native_input(struct module *m, int64_t *value);
+void native_output(struct module *m, int64_t value);
+
+static inline int native_ready(struct module *m, int64_t pc)
+{
+	return (uint64_t)pc < m->native->isize && m->native->entry[pc];
+}
+
+/* memory accesses of the generated code, the cells of the program
+ * and the ones outside of the memory take the slow path */
+static inline int64_t native_get(struct module *m, int64_t addr)
+{
+	if ((uint64_t)addr < m->size)
+	{
+		return m->ram[addr];
+	}
+	return native_load(m, addr);
+}
+
+/* returns 0 if the store dropped the translated program */
+static inline int native_put(struct module *m, int64_t addr, int64_t value)
+{
+	if ((uint64_t)addr < m->size && (uint64_t)addr >= m->ncode)
+	{
+		m->ram[addr] = value;
+		m->dirty[addr >> PAGE_SHIFT] = 1;
+		return 1;
+	}
+	native_store(m, addr, value);
+	return m->native != NULL;
+}
+
+#endif
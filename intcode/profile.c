@@ -0,0 +1,204 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "module.h"
+#include "profile.h"
+
+#ifdef INTCODE_PROFILE
+
+struct row
+{
+	uint64_t count;
+	int64_t key;
+	uint64_t extra;
+};
+
+static int row_cmp(const void *a, const void *b)
+{
+	const struct row *ra = a;
+	const struct row *rb = b;
+	return ra->count < rb->count ? 1 : ra->count > rb->count ? -1 : 0;
+}
+
+/* sort the rows by count and keep the first PROFILE_TOP */
+static size_t row_top(struct row *rows, size_t n)
+{
+	qsort(rows, n, sizeof(*rows), row_cmp);
+	return n < PROFILE_TOP ? n : PROFILE_TOP;
+}
+
+static const char *const op_name[256] = {
+	[OP_ADD] = "ADD",
+	[OP_MUL] = "MUL",
+	[OP_IN] = "IN",
+	[OP_OUT] = "OUT",
+	[OP_JNZ] = "JNZ",
+	[OP_JZ] = "JZ",
+	[OP_TLT] = "TLT",
+	[OP_TEQ] = "TEQ",
+	[OP_ARB] = "ARB",
+	[OP_HALT] = "HALT",
+	[INSN_FAULT] = "FAULT",
+	[INSN_TLT_JNZ] = "TLT+JNZ",
+	[INSN_TLT_JZ] = "TLT+JZ",
+	[INSN_TEQ_JNZ] = "TEQ+JNZ",
+	[INSN_TEQ_JZ] = "TEQ+JZ",
+	[INSN_ARB_JMP] = "ARB+JMP",
+};
+
+void profile_load(struct module *m, size_t psize)
+{
+	struct profile *p = m->profile;
+	if (!p)
+	{
+		p = m->profile = calloc(1, sizeof(*p));
+		if (!p)
+		{
+			fprintf(stderr, "Cannot allocate the profile\n");
+			abort();
+		}
+	}
+	p->retired += m->steps;
+	if (p->npc >= psize)
+	{
+		return;
+	}
+
+	/* NOTE: the counts of the cells of the previous programs
+	 * are kept */
+	uint64_t *pc = realloc(p->pc, psize * sizeof(*pc));
+	if (pc) p->pc = pc;
+	uint64_t *branch = realloc(p->branch, psize * sizeof(*branch));
+	if (branch) p->branch = branch;
+	uint64_t *taken = realloc(p->taken, psize * sizeof(*taken));
+	if (taken) p->taken = taken;
+	if (!pc || !branch || !taken)
+	{
+		fprintf(stderr, "Cannot grow the profile to %zu cells\n", psize);
+		abort();
+	}
+	memset(pc + p->npc, 0, (psize - p->npc) * sizeof(*pc));
+	memset(branch + p->npc, 0, (psize - p->npc) * sizeof(*branch));
+	memset(taken + p->npc, 0, (psize - p->npc) * sizeof(*taken));
+	p->npc = psize;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+	return total ? 100.0 * part / total : 0.0;
+}
+
+static void profile_report(struct profile *p, uint64_t retired)
+{
+	uint64_t total = 0;
+	for (int op = 0; op < 256; op++)
+	{
+		total += p->op[op];
+	}
+	if (total == 0)
+	{
+		return;
+	}
+
+	/* NOTE: an input that stops the interpreter is counted
+	 * again when it resumes, but it is retired once */
+	fprintf(stderr, "profile: %" PRIu64 " retired, %" PRIu64
+		" interpreted (%.1f%%) in %" PRIu64 " dispatches\n", retired,
+		total + p->fused, percent(total + p->fused, retired), total);
+
+	fprintf(stderr, "\n%-8s %14s %7s\n", "opcode", "count", "%");
+	for (int op = 0; op < 256; op++)
+	{
+		if (p->op[op])
+		{
+			fprintf(stderr, "%-8s %14" PRIu64 " %6.2f%%\n",
+				op_name[op], p->op[op], percent(p->op[op], total));
+		}
+	}
+
+	struct row *rows = malloc((p->npc > 100 * 27 ? p->npc : 100 * 27) * sizeof(*rows));
+	if (!rows)
+	{
+		return;
+	}
+
+	size_t n = 0;
+	for (int op = 0; op < 100; op++)
+	{
+		for (int mode = 0; mode < 27; mode++)
+		{
+			if (p->mode[op][mode])
+			{
+				/* the instruction word with the modes */
+				int64_t word = op + 100 * (mode % 3) +
+					1000 * (mode / 3 % 3) + 10000 * (mode / 9);
+				rows[n++] = (struct row){ p->mode[op][mode], word, 0 };
+			}
+		}
+	}
+	n = row_top(rows, n);
+	fprintf(stderr, "\n%-8s %14s %7s\n", "modes", "count", "%");
+	for (size_t k = 0; k < n; k++)
+	{
+		fprintf(stderr, "%-8" PRId64 " %14" PRIu64 " %6.2f%%\n",
+			rows[k].key, rows[k].count, percent(rows[k].count, total));
+	}
+
+	n = 0;
+	for (size_t pc = 0; pc < p->npc; pc++)
+	{
+		if (p->pc[pc])
+		{
+			rows[n++] = (struct row){ p->pc[pc], pc, 0 };
+		}
+	}
+	size_t nhot = row_top(rows, n);
+	fprintf(stderr, "\n%-8s %14s %7s\n", "pc", "count", "%");
+	for (size_t k = 0; k < nhot; k++)
+	{
+		fprintf(stderr, "%-8" PRId64 " %14" PRIu64 " %6.2f%%\n",
+			rows[k].key, rows[k].count, percent(rows[k].count, total));
+	}
+	if (p->outside)
+	{
+		fprintf(stderr, "%-8s %14" PRIu64 " %6.2f%%\n",
+			"outside", p->outside, percent(p->outside, total));
+	}
+
+	n = 0;
+	for (size_t pc = 0; pc < p->npc; pc++)
+	{
+		if (p->branch[pc])
+		{
+			rows[n++] = (struct row){ p->branch[pc], pc, p->taken[pc] };
+		}
+	}
+	n = row_top(rows, n);
+	fprintf(stderr, "\n%-8s %14s %14s %7s\n", "branch", "count", "taken", "%");
+	for (size_t k = 0; k < n; k++)
+	{
+		fprintf(stderr, "%-8" PRId64 " %14" PRIu64 " %14" PRIu64 " %6.2f%%\n",
+			rows[k].key, rows[k].count, rows[k].extra,
+			percent(rows[k].extra, rows[k].count));
+	}
+	free(rows);
+}
+
+void profile_free(struct module *m)
+{
+	struct profile *p = m->profile;
+	if (p)
+	{
+		profile_report(p, p->retired + m->steps);
+		free(p->taken);
+		free(p->branch);
+		free(p->pc);
+		free(p);
+		m->profile = NULL;
+	}
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/*
+ * Execution profile of the interpreter, built with INTCODE_PROFILE:
+ * the dispatches are counted by opcode, superinstructions included,
+ * by the addressing modes of their first instruction and by address,
+ * and the conditional jumps by outcome. The counts are
+ * summed over the programs loaded by the module and the report is
+ * printed to stderr by module_free(). The instructions run by the JIT
+ * or by a program translated by icc are not profiled, the report
+ * only gives their share of the retired instructions.
+ */
+
+#include <stdint.h>
+
+#include "module.h"
+
+#ifdef INTCODE_PROFILE
+
+/* rows of each table of the report */
+#define PROFILE_TOP 16
+
+struct profile
+{
+	uint64_t op[256];	/* executions of each decoded opcode */
+	uint64_t fused;		/* superinstructions among them */
+	uint64_t mode[100][27];	/* by opcode and modes a + 3*b + 9*c */
+	uint64_t *pc;		/* executions at each address */
+	uint64_t *branch;	/* conditional jumps at each address */
+	uint64_t *taken;	/* the ones that were taken */
+	size_t npc;
+	uint64_t outside;	/* executions outside of the program */
+	uint64_t retired;	/* steps of the previous loads */
+};
+
+/* make room for a program of psize cells, aborts on error */
+void profile_load(struct module *m, size_t psize);
+
+/* print the report to stderr and release the profile */
+void profile_free(struct module *m);
+
+static inline void profile_insn(struct module *m, const struct insn *i)
+{
+	static const uint8_t pmode[] = {
+		[ARG_IMM] = IMODE,
+		[ARG_ABS] = PMODE,
+		[ARG_FAR] = PMODE,
+		[ARG_REL] = RMODE,
+		[ARG_NEAR] = RMODE,
+	};
+	struct profile *p = m->profile;
+	int op = insn_unfused(i->op);
+	p->op[i->op]++;
+	p->fused += op != i->op;
+	if (op < 100)
+	{
+		int mode = 0;
+		for (int k = 0, scale = 1; k < op_args[op]; k++, scale *= 3)
+		{
+			mode += scale * pmode[i->kind[k]];
+		}
+		p->mode[op][mode]++;
+	}
+	if ((uint64_t)m->pc < p->npc)
+	{
+		p->pc[m->pc]++;
+	}
+	else
+	{
+		p->outside++;
+	}
+}
+
+/* count the conditional jump at m->pc */
+static inline void profile_branch(struct module *m, int taken)
+{
+	struct profile *p = m->profile;
+	if ((uint64_t)m->pc < p->npc)
+	{
+		p->branch[m->pc]++;
+		p->taken[m->pc] += taken;
+	}
+}
+
+#endif
+
+#endif
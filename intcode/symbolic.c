@@ -0,0 +1,591 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intcode.h"
+
+/*
+ * Symbolic execution: every cell of the memory holds an expression
+ * over the symbols instead of a value. The expressions are nodes of a
+ * DAG that are built once (hash consing) and simplified on the way:
+ * constants are folded and the affine parts are kept together, so the
+ * expressions of the usual programs stay small. The opcodes, the
+ * addresses, the jumps and rbp must be constants, then the program
+ * takes the same path for any value of the symbols and the expressions
+ * it leaves are exact.
+ */
+
+enum
+{
+	N_CONST,		/* value */
+	N_SYM,			/* symbol number value */
+	N_POISON,		/* read through a symbolic address */
+	N_ADD,
+	N_MUL,
+	N_LT,
+	N_EQ,
+};
+
+struct node
+{
+	uint8_t op;
+	uint32_t a, b;		/* operands */
+	int64_t value;
+};
+
+/* the memory cannot grow above this size */
+#define SYM_MAX_CELLS	(1 << 20)
+
+/* longest compiled expression */
+#define EXPR_MAX_OPS	4096
+
+struct symbolic
+{
+	struct node *node;	/* node 0 is the constant 0 */
+	size_t nnodes;
+	size_t cap;
+
+	uint32_t *hash;		/* open addressing, node + 1 or 0 */
+	size_t hcap;		/* power of two */
+
+	uint32_t *mem;		/* node of each cell */
+	size_t size;
+
+	uint32_t *out;		/* node of each output */
+	size_t nout;
+	size_t ocap;
+
+	size_t nsyms;
+};
+
+struct expr
+{
+	size_t n;
+	struct node op[];	/* operands are indices of earlier ops */
+};
+
+static uint64_t node_hash(uint8_t op, uint32_t a, uint32_t b, int64_t value)
+{
+	uint64_t h = op;
+	h = (h ^ a) * UINT64_C(0x9e3779b97f4a7c15);
+	h = (h ^ b) * UINT64_C(0x9e3779b97f4a7c15);
+	h = (h ^ (uint64_t)value) * UINT64_C(0x9e3779b97f4a7c15);
+	return h ^ h >> 29;
+}
+
+static void sym_rehash(struct symbolic *s)
+{
+	size_t n = s->hcap ? s->hcap * 2 : 1024;
+	uint32_t *hash = calloc(n, sizeof(*hash));
+	if (!hash)
+	{
+		fprintf(stderr, "Cannot allocate the symbolic nodes\n");
+		abort();
+	}
+	for (size_t k = 0; k < s->nnodes; k++)
+	{
+		const struct node *x = s->node + k;
+		size_t i = node_hash(x->op, x->a, x->b, x->value) & (n - 1);
+		while (hash[i])
+		{
+			i = (i + 1) & (n - 1);
+		}
+		hash[i] = k + 1;
+	}
+	free(s->hash);
+	s->hash = hash;
+	s->hcap = n;
+}
+
+static uint32_t node_new(struct symbolic *s, uint8_t op, uint32_t a, uint32_t b,
+			 int64_t value)
+{
+	if (s->nnodes * 2 >= s->hcap)
+	{
+		sym_rehash(s);
+	}
+	size_t i = node_hash(op, a, b, value) & (s->hcap - 1);
+	while (s->hash[i])
+	{
+		const struct node *x = s->node + s->hash[i] - 1;
+		if (x->op == op && x->a == a && x->b == b && x->value == value)
+		{
+			return s->hash[i] - 1;
+		}
+		i = (i + 1) & (s->hcap - 1);
+	}
+
+	if (s->nnodes == s->cap)
+	{
+		size_t ncap = s->cap ? s->cap * 2 : 1024;
+		struct node *node = realloc(s->node, ncap * sizeof(*node));
+		if (!node)
+		{
+			fprintf(stderr, "Cannot allocate the symbolic nodes\n");
+			abort();
+		}
+		s->node = node;
+		s->cap = ncap;
+	}
+	s->node[s->nnodes] = (struct node){ op, a, b, value };
+	s->hash[i] = ++s->nnodes;
+	return s->nnodes - 1;
+}
+
+static uint32_t sym_const(struct symbolic *s, int64_t value)
+{
+	return node_new(s, N_CONST, 0, 0, value);
+}
+
+static int is_const(struct symbolic *s, uint32_t x)
+{
+	return s->node[x].op == N_CONST;
+}
+
+static int is_poison(struct symbolic *s, uint32_t x)
+{
+	return s->node[x].op == N_POISON;
+}
+
+static int64_t value_of(struct symbolic *s, uint32_t x)
+{
+	return s->node[x].value;
+}
+
+/* NOTE: the arithmetic wraps around like the one of the interpreter */
+static uint32_t sym_add(struct symbolic *s, uint32_t a, uint32_t b)
+{
+	if (is_const(s, a))
+	{
+		uint32_t t = a; a = b; b = t;
+	}
+	if (is_const(s, b))
+	{
+		int64_t c = value_of(s, b);
+		if (is_const(s, a))
+		{
+			return sym_const(s, (uint64_t)value_of(s, a) + c);
+		}
+		if (c == 0)
+		{
+			return a;
+		}
+		/* (x + c1) + c2 = x + (c1 + c2) */
+		const struct node *x = s->node + a;
+		if (x->op == N_ADD && is_const(s, x->b))
+		{
+			uint32_t xa = x->a;
+			return sym_add(s, xa, sym_const(s, (uint64_t)value_of(s, x->b) + c));
+		}
+	}
+	else if (a > b)
+	{
+		uint32_t t = a; a = b; b = t;
+	}
+	if (is_poison(s, a) || is_poison(s, b))
+	{
+		return node_new(s, N_POISON, 0, 0, 0);
+	}
+	return node_new(s, N_ADD, a, b, 0);
+}
+
+static uint32_t sym_mul(struct symbolic *s, uint32_t a, uint32_t b)
+{
+	if (is_const(s, a))
+	{
+		uint32_t t = a; a = b; b = t;
+	}
+	if (is_const(s, b))
+	{
+		int64_t c = value_of(s, b);
+		if (is_const(s, a))
+		{
+			return sym_const(s, (uint64_t)value_of(s, a) * c);
+		}
+		/* NOTE: the read through a symbolic address has some
+		 * value, times 0 it is known */
+		if (c == 0 || c == 1)
+		{
+			return c ? a : b;
+		}
+		const struct node *x = s->node + a;
+		if (x->op == N_MUL && is_const(s, x->b))
+		{
+			/* (x * c1) * c2 = x * (c1 * c2) */
+			uint32_t xa = x->a;
+			return sym_mul(s, xa, sym_const(s, (uint64_t)value_of(s, x->b) * c));
+		}
+		if (x->op == N_ADD && is_const(s, x->b))
+		{
+			/* (x + c1) * c2 = x * c2 + c1 * c2 */
+			uint32_t xa = x->a;
+			int64_t c1 = value_of(s, x->b);
+			return sym_add(s, sym_mul(s, xa, b),
+				       sym_const(s, (uint64_t)c1 * c));
+		}
+	}
+	else if (a > b)
+	{
+		uint32_t t = a; a = b; b = t;
+	}
+	if (is_poison(s, a) || is_poison(s, b))
+	{
+		return node_new(s, N_POISON, 0, 0, 0);
+	}
+	return node_new(s, N_MUL, a, b, 0);
+}
+
+static uint32_t sym_cmp(struct symbolic *s, uint8_t op, uint32_t a, uint32_t b)
+{
+	if (is_const(s, a) && is_const(s, b))
+	{
+		int64_t x = value_of(s, a);
+		int64_t y = value_of(s, b);
+		return sym_const(s, op == N_LT ? x < y : x == y);
+	}
+	if (is_poison(s, a) || is_poison(s, b))
+	{
+		return node_new(s, N_POISON, 0, 0, 0);
+	}
+	if (a == b)
+	{
+		return sym_const(s, op == N_EQ);
+	}
+	if (op == N_EQ && a > b)
+	{
+		uint32_t t = a; a = b; b = t;
+	}
+	return node_new(s, op, a, b, 0);
+}
+
+/* the cell at addr, NULL if the memory cannot grow there */
+static uint32_t *sym_cell(struct symbolic *s, int64_t addr)
+{
+	if (addr < 0 || addr >= SYM_MAX_CELLS)
+	{
+		return NULL;
+	}
+	if ((size_t)addr >= s->size)
+	{
+		size_t nsize = s->size ? s->size : 1024;
+		while ((size_t)addr >= nsize)
+		{
+			nsize *= 2;
+		}
+		uint32_t *mem = realloc(s->mem, nsize * sizeof(*mem));
+		if (!mem)
+		{
+			return NULL;
+		}
+		memset(mem + s->size, 0, (nsize - s->size) * sizeof(*mem));
+		s->mem = mem;
+		s->size = nsize;
+	}
+	return s->mem + addr;
+}
+
+static int sym_output(struct symbolic *s, uint32_t x)
+{
+	if (s->nout == s->ocap)
+	{
+		size_t ncap = s->ocap ? s->ocap * 2 : 16;
+		uint32_t *out = realloc(s->out, ncap * sizeof(*out));
+		if (!out)
+		{
+			return 0;
+		}
+		s->out = out;
+		s->ocap = ncap;
+	}
+	s->out[s->nout++] = x;
+	return 1;
+}
+
+void symbolic_free(struct symbolic *s)
+{
+	if (s)
+	{
+		free(s->node);
+		free(s->hash);
+		free(s->mem);
+		free(s->out);
+		free(s);
+	}
+}
+
+/* the address of the operand k of the instruction at pc, -1 if it
+ * depends on the symbols */
+static int64_t sym_addr(struct symbolic *s, int64_t pc, int64_t rbp, int mode, int k)
+{
+	uint32_t x = s->mem[pc + k];
+	if (!is_const(s, x))
+	{
+		return -1;
+	}
+	int64_t addr = value_of(s, x);
+	if (mode == RMODE)
+	{
+		addr += rbp;
+	}
+	return addr < 0 ? -2 : addr;
+}
+
+struct symbolic *program_symbolic(const int64_t *prog, size_t psize,
+				  const int64_t *cells, size_t ncells,
+				  const int64_t *inputs, size_t ninputs,
+				  uint64_t max_steps)
+{
+	struct symbolic *s = calloc(1, sizeof(*s));
+	if (!s)
+	{
+		return NULL;
+	}
+	sym_const(s, 0);
+	if (psize && !sym_cell(s, psize - 1))
+	{
+		goto fail;
+	}
+	for (size_t k = 0; k < psize; k++)
+	{
+		s->mem[k] = sym_const(s, prog[k]);
+	}
+	for (size_t k = 0; k < ncells; k++)
+	{
+		uint32_t *c = sym_cell(s, cells[k]);
+		if (!c)
+		{
+			goto fail;
+		}
+		*c = node_new(s, N_SYM, 0, 0, s->nsyms++);
+	}
+
+	int64_t pc = 0;
+	int64_t rbp = 0;
+	size_t nread = 0;
+	for (uint64_t steps = 0; steps < max_steps; steps++)
+	{
+		/* NOTE: the operands must be in the memory too */
+		if (!sym_cell(s, pc + 3) || !is_const(s, s->mem[pc]))
+		{
+			goto fail;
+		}
+		int64_t insn = value_of(s, s->mem[pc]);
+		int op = insn % 100;
+		if (insn < 0 || op == OP_HALT)
+		{
+			if (op != OP_HALT)
+			{
+				goto fail;
+			}
+			return s;
+		}
+
+		int nargs;
+		switch (op)
+		{
+		case OP_ADD: case OP_MUL: case OP_TLT: case OP_TEQ: nargs = 3; break;
+		case OP_JNZ: case OP_JZ: nargs = 2; break;
+		case OP_IN: case OP_OUT: case OP_ARB: nargs = 1; break;
+		default: goto fail;
+		}
+
+		/* the value of the operands and the cell written */
+		uint32_t val[3] = { 0, 0, 0 };
+		uint32_t *dst = NULL;
+		int64_t mode = insn / 100;
+		for (int k = 0; k < nargs; k++, mode /= 10)
+		{
+			int write = op == OP_IN || k == 2;
+			if (mode % 10 == IMODE && !write)
+			{
+				val[k] = s->mem[pc + 1 + k];
+				continue;
+			}
+			if (mode % 10 != PMODE && mode % 10 != RMODE)
+			{
+				goto fail;
+			}
+			int64_t addr = sym_addr(s, pc, rbp, mode % 10, 1 + k);
+			if (write)
+			{
+				dst = addr >= 0 ? sym_cell(s, addr) : NULL;
+				if (!dst)
+				{
+					goto fail;
+				}
+			}
+			else if (addr == -1)
+			{
+				val[k] = node_new(s, N_POISON, 0, 0, 0);
+			}
+			else if (addr < 0)
+			{
+				goto fail;
+			}
+			else
+			{
+				val[k] = (size_t)addr < s->size ? s->mem[addr] : 0;
+			}
+		}
+
+		pc += 1 + nargs;
+		switch (op)
+		{
+		case OP_ADD: *dst = sym_add(s, val[0], val[1]); break;
+		case OP_MUL: *dst = sym_mul(s, val[0], val[1]); break;
+		case OP_TLT: *dst = sym_cmp(s, N_LT, val[0], val[1]); break;
+		case OP_TEQ: *dst = sym_cmp(s, N_EQ, val[0], val[1]); break;
+
+		case OP_IN:
+			if (nread < ninputs)
+			{
+				*dst = sym_const(s, inputs[nread++]);
+			}
+			else
+			{
+				*dst = node_new(s, N_SYM, 0, 0, s->nsyms++);
+			}
+			break;
+
+		case OP_OUT:
+			if (!sym_output(s, val[0]))
+			{
+				goto fail;
+			}
+			break;
+
+		case OP_JNZ:
+		case OP_JZ:
+			/* the path must not depend on the symbols */
+			if (!is_const(s, val[0]))
+			{
+				goto fail;
+			}
+			if ((value_of(s, val[0]) != 0) == (op == OP_JNZ))
+			{
+				if (!is_const(s, val[1]) || value_of(s, val[1]) < 0)
+				{
+					goto fail;
+				}
+				pc = value_of(s, val[1]);
+			}
+			break;
+
+		case OP_ARB:
+			if (!is_const(s, val[0]))
+			{
+				goto fail;
+			}
+			rbp += value_of(s, val[0]);
+			break;
+		}
+	}
+
+fail:
+	symbolic_free(s);
+	return NULL;
+}
+
+size_t symbolic_symbols(const struct symbolic *s)
+{
+	return s->nsyms;
+}
+
+size_t symbolic_outputs(const struct symbolic *s)
+{
+	return s->nout;
+}
+
+/*
+ * the nodes reachable from root in the order they are evaluated: the
+ * operands of a node were built before it, so the order of the nodes
+ * is already right
+ */
+static struct expr *sym_compile(const struct symbolic *s, uint32_t root)
+{
+	if (s->node[root].op == N_POISON)
+	{
+		return NULL;
+	}
+
+	uint32_t *slot = calloc(root + 1, sizeof(*slot));
+	if (!slot)
+	{
+		return NULL;
+	}
+	slot[root] = 1;
+	for (uint32_t x = root + 1; x-- > 0; )
+	{
+		if (slot[x] && s->node[x].op >= N_ADD)
+		{
+			slot[s->node[x].a] = slot[s->node[x].b] = 1;
+		}
+	}
+	size_t n = 0;
+	for (uint32_t x = 0; x <= root; x++)
+	{
+		slot[x] = slot[x] ? n++ : UINT32_MAX;
+	}
+
+	struct expr *e = NULL;
+	if (n <= EXPR_MAX_OPS)
+	{
+		e = malloc(sizeof(*e) + n * sizeof(e->op[0]));
+	}
+	if (e)
+	{
+		e->n = n;
+		for (uint32_t x = 0; x <= root; x++)
+		{
+			if (slot[x] != UINT32_MAX)
+			{
+				struct node op = s->node[x];
+				if (op.op >= N_ADD)
+				{
+					op.a = slot[op.a];
+					op.b = slot[op.b];
+				}
+				e->op[slot[x]] = op;
+			}
+		}
+	}
+	free(slot);
+	return e;
+}
+
+struct expr *symbolic_output(const struct symbolic *s, size_t k)
+{
+	return k < s->nout ? sym_compile(s, s->out[k]) : NULL;
+}
+
+struct expr *symbolic_cell(const struct symbolic *s, int64_t addr)
+{
+	uint32_t x = addr >= 0 && (size_t)addr < s->size ? s->mem[addr] : 0;
+	return sym_compile(s, x);
+}
+
+int64_t expr_eval(const struct expr *e, const int64_t *symbols)
+{
+	int64_t r[e->n];
+	for (size_t i = 0; i < e->n; i++)
+	{
+		const struct node *op = e->op + i;
+		switch (op->op)
+		{
+		case N_CONST: r[i] = op->value; break;
+		case N_SYM:   r[i] = symbols[op->value]; break;
+		case N_ADD:   r[i] = (uint64_t)r[op->a] + r[op->b]; break;
+		case N_MUL:   r[i] = (uint64_t)r[op->a] * r[op->b]; break;
+		case N_LT:    r[i] = r[op->a] < r[op->b]; break;
+		case N_EQ:    r[i] = r[op->a] == r[op->b]; break;
+		}
+	}
+	return r[e->n - 1];
+}
+
+void expr_free(struct expr *e)
+{
+	free(e);
+}